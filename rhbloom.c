@@ -6,6 +6,11 @@
 //
 // rhbloom: Robin hood bloom filter
 
+// For MAP_ANONYMOUS, syscall, and clock_gettime under a strict -std=c99.
+#if defined(__linux__) && !defined(_DEFAULT_SOURCE)
+#define _DEFAULT_SOURCE
+#endif
+
 #include <stdio.h>
 #include <assert.h>
 #include <math.h>
@@ -14,32 +19,426 @@
 #include <stdlib.h>
 #include "rhbloom.h"
 
+#ifdef RHBLOOM_STATS
+#include <time.h>
+#endif
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#define RHBLOOM_MMAP
+#endif
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define RHBLOOM_X86_SIMD
+#include <immintrin.h>
+#endif
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define RHBLOOM_BIG_ENDIAN
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define RHBLOOM_ATOMICS
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+struct rhbloom;
+struct rhbloom_sync;
+
+// Number of buckets, as u64 words, that are kept inline in the filter. The
+// first table lives there, so a small filter is one allocation.
+#define RHBLOOM_SMALL 16
+
+// Alignment of the bloom bits, so that a block never straddles cache lines.
+#define RHBLOOM_ALIGN 64
+
+// Highest load factor of the hashmap. Past that, probes get long.
+#define RHBLOOM_MAXLOAD 0.95
+
+#ifdef RHBLOOM_STATS
+// Hot path counters. Concurrent filters have one slot per stripe and each
+// thread sticks to its own slot, so the counters of different threads don't
+// share cache lines. Other filters have a single slot, inline in the filter.
+struct rhbloom_counters {
+    uint64_t probes;        // hashmap probes by adds and tests
+    uint64_t probe_length;  // buckets visited by those probes
+    uint64_t max_probe;     // longest probe
+    uint64_t bloom_tests;   // tests of the bloom bits
+    uint64_t bloom_bits;    // bits read by those tests
+    char pad[RHBLOOM_ALIGN-sizeof(uint64_t)*5];
+};
+#endif
+
+// Tests many mixed keys against the bloom bits.
+typedef void (*rhbloom_testbits_fn)(struct rhbloom *rhbloom,
+    const uint64_t *keys, size_t n, bool *out);
+
 struct rhbloom {
     // allocator
-    void*(*malloc)(size_t);
+    void*(*malloc)(size_t);  // plain allocator, unless allocator is set
     void(*free)(void*);
+    struct rhbloom_allocator allocator; // allocator with a context, or zeros
     
     // robinhood fields
     size_t count;       // number of keys in hashtable
     size_t nbuckets;    // number of buckets
     uint64_t *buckets;  // hashtable buckets
+    uint64_t small[RHBLOOM_SMALL]; // inline buckets of the smallest table
+    size_t load;        // max load of a table, in 256ths of the buckets
+    double upgrade;     // upgrade at this ratio of table to bloom size
+    size_t budget;      // largest table in bytes, or 0 for no limit
+    bool simd;          // scan the 64-bit buckets with avx2
 
     // bloom fields
     size_t k;           // number of bits per key
     size_t m;           // number of bits total
-    uint8_t *bits;      // bloom bits
+    size_t pmask;       // probe mask, m-1 or the block mask when blocked
+    bool counting;      // bits are 4-bit counters, allowing deletes
+    bool branchless;    // tests read all k bits, without an early exit
+    size_t nbits;       // number of set bits or nonzero counters
+    uint64_t *bits;     // bloom bits, aligned to RHBLOOM_ALIGN
+    void *bitsmem;      // unaligned allocation backing bits
+    size_t bitsmapped;  // length of the mapping at bitsmem, 0 if allocated
+    enum rhbloom_pages pages; // page size of the bits
+    enum rhbloom_numa numa;   // numa policy of the bits
+    int numa_node;            // node of RHBLOOM_NUMA_BIND
+    rhbloom_testbits_fn testbits; // batch kernel picked for this cpu
+
+    // concurrency
+    struct rhbloom_sync *sync; // shared state, only for concurrent filters
+
+    // read-only view
+    bool view;          // bits or buckets point into borrowed memory
+
+    // incremental growth
+    bool incremental;       // migrate a few buckets per operation
+    uint64_t *buckets_old;  // buckets still being migrated, or NULL
+    size_t nbuckets_old;    // number of old buckets
+    size_t migrated;        // number of old buckets migrated so far
+    size_t nold;            // number of keys left in the old buckets
+
+    // compressed hashmap
+    int fpbits;             // fingerprint bits kept of each key, or 0
+    int fpwidth;            // slot width of the largest table, 16 or 32
+    uint64_t fpmask;        // mask for the fingerprint bits of a key
+
+    // scalable layers
+    bool scalable;          // chain a new layer when the newest one is full
+    size_t cap;             // number of keys that the newest layer holds
+    double p;               // false positive rate of the newest layer
+    size_t nkeys;           // number of keys that set bits in the newest layer
+    struct rhbloom *prev;   // next older layer, or NULL
+
+    // replication
+    bool tracking;          // track the changes since the last delta
+    bool overflow;          // changed in ways that only a full delta carries
+    uint64_t snapshot;      // id of the last delta written or applied, or 0
+    uint64_t *keylog;       // hashed keys added to the hashmap since then
+    size_t nlog;            // number of logged keys
+    size_t logcap;          // capacity of the log
+    uint64_t *dirty;        // one bit per changed block of the bloom bits
+
+#ifdef RHBLOOM_STATS
+    // instrumentation
+    struct rhbloom_counters *counters; // per-thread slots of hot counters
+    struct rhbloom_counters counter;   // the only slot, when not concurrent
+    uint64_t grows;         // number of grows, including the upgrade
+    uint64_t grow_ns;       // nanoseconds spent growing
+    uint64_t upgrade_ns;    // realtime nanoseconds when upgraded, or 0
+#endif
+};
+
+// Bits per block in blocked layout, one 64-byte cache line.
+#define RHBLOOM_BLOCKBITS 512
+
+// Largest value of a 4-bit counter. A saturated counter is never decremented.
+#define RHBLOOM_COUNTMAX 15
+
+// Bytes per block of the bloom bits that a delta ships whole when any of its
+// bits changed. Small enough that a sparse change stays small, large enough
+// that the dirty bitmap is a tiny fraction of the bits.
+#define RHBLOOM_DELTABLOCK 4096
+
+// Number of keys that are mixed and prefetched ahead in the batch functions.
+#define RHBLOOM_BATCH 16
+
+// Number of old buckets that each operation migrates in incremental mode.
+// Must be more than 2 so that a rehash finishes before the new buckets fill.
+#define RHBLOOM_MIGRATE 8
+
+#ifdef RHBLOOM_ATOMICS
+#define RHBLOOM_PREFETCH(addr) __builtin_prefetch((addr))
+#define RHBLOOM_OR_RELAXED(ptr, val) \
+    __atomic_fetch_or((ptr), (val), __ATOMIC_RELAXED)
+#define RHBLOOM_LOAD_RELAXED(ptr) __atomic_load_n((ptr), __ATOMIC_RELAXED)
+#define RHBLOOM_LOAD_ACQUIRE(ptr) __atomic_load_n((ptr), __ATOMIC_ACQUIRE)
+#define RHBLOOM_LOAD_SEQCST(ptr) __atomic_load_n((ptr), __ATOMIC_SEQ_CST)
+#define RHBLOOM_STORE_RELAXED(ptr, val) \
+    __atomic_store_n((ptr), (val), __ATOMIC_RELAXED)
+#define RHBLOOM_STORE_RELEASE(ptr, val) \
+    __atomic_store_n((ptr), (val), __ATOMIC_RELEASE)
+#define RHBLOOM_ADD_SEQCST(ptr, val) \
+    __atomic_add_fetch((ptr), (val), __ATOMIC_SEQ_CST)
+#define RHBLOOM_ADD_RELAXED(ptr, val) \
+    __atomic_add_fetch((ptr), (val), __ATOMIC_RELAXED)
+#define RHBLOOM_SUB_RELEASE(ptr, val) \
+    __atomic_sub_fetch((ptr), (val), __ATOMIC_RELEASE)
+#define RHBLOOM_FENCE_ACQUIRE() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define RHBLOOM_FENCE_RELEASE() __atomic_thread_fence(__ATOMIC_RELEASE)
+#define RHBLOOM_FENCE_SEQCST() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#else
+#define RHBLOOM_PREFETCH(addr) ((void)(addr))
+#define RHBLOOM_OR_RELAXED(ptr, val) (*(ptr) |= (val))
+#define RHBLOOM_LOAD_RELAXED(ptr) (*(ptr))
+#define RHBLOOM_LOAD_ACQUIRE(ptr) (*(ptr))
+#define RHBLOOM_STORE_RELAXED(ptr, val) (*(ptr) = (val))
+#define RHBLOOM_STORE_RELEASE(ptr, val) (*(ptr) = (val))
+#endif
+
+// Number of reader counter stripes for concurrent filters.
+#define RHBLOOM_STRIPES 16
+
+#ifdef RHBLOOM_ATOMICS
+// Shared state of a concurrent filter.
+//
+// Writers take the lock while in the hashmap phase. Readers never lock.
+// Changes to the buckets are wrapped in a seqlock, and readers retry their
+// probe if the sequence moved underneath them. Replaced buckets are freed
+// only after a grace period: the writer flips the epoch and waits for the
+// readers counted in the previous epoch to leave. A grow fills its new
+// buckets or bits before publishing them, so readers never see a partial
+// table.
+struct rhbloom_sync {
+    pthread_mutex_t lock;   // serializes writers in the hashmap phase
+    size_t seq;             // seqlock sequence, odd while buckets change
+    size_t epoch;           // reader epoch, flipped before freeing buckets
+    struct {
+        size_t readers[2];  // readers inside of even and odd epochs
+        size_t nbits;       // bloom bits set by adders on this stripe
+        char pad[RHBLOOM_ALIGN-sizeof(size_t)*3];
+    } stripes[RHBLOOM_STRIPES];
 };
+#endif
+
+#ifdef RHBLOOM_STATS
+static size_t rhbloom_nslots(struct rhbloom *rhbloom) {
+    return rhbloom->sync ? RHBLOOM_STRIPES : 1;
+}
+
+// Slot of the calling thread. Threads are handed slots in turn as they first
+// show up.
+static struct rhbloom_counters *rhbloom_slot(struct rhbloom *rhbloom) {
+#ifdef RHBLOOM_ATOMICS
+    if (rhbloom->sync) {
+        static size_t nthreads = 0;
+        static __thread size_t slot = 0;
+        if (!slot) {
+            slot = RHBLOOM_ADD_RELAXED(&nthreads, 1);
+        }
+        return &rhbloom->counters[(slot-1) & (RHBLOOM_STRIPES-1)];
+    }
+#endif
+    return rhbloom->counters;
+}
+
+// Add to a counter of the calling thread. Threads only share a slot when
+// there are more threads than stripes, so the atomic add is uncontended.
+static void rhbloom_stat_add(struct rhbloom *rhbloom, uint64_t *counter, 
+    uint64_t n)
+{
+#ifdef RHBLOOM_ATOMICS
+    if (rhbloom->sync) {
+        RHBLOOM_ADD_RELAXED(counter, n);
+        return;
+    }
+#endif
+    *counter += n;
+}
+
+static void rhbloom_stat_probe(struct rhbloom *rhbloom, size_t len) {
+    struct rhbloom_counters *slot = rhbloom_slot(rhbloom);
+    rhbloom_stat_add(rhbloom, &slot->probes, 1);
+    rhbloom_stat_add(rhbloom, &slot->probe_length, len);
+    // A racing thread on a shared slot may win with a shorter probe, which
+    // is fine for a statistic.
+    if (len > RHBLOOM_LOAD_RELAXED(&slot->max_probe)) {
+        RHBLOOM_STORE_RELAXED(&slot->max_probe, len);
+    }
+}
+
+static void rhbloom_stat_bloom(struct rhbloom *rhbloom, size_t ntests, 
+    size_t nbits)
+{
+    struct rhbloom_counters *slot = rhbloom_slot(rhbloom);
+    rhbloom_stat_add(rhbloom, &slot->bloom_tests, ntests);
+    rhbloom_stat_add(rhbloom, &slot->bloom_bits, nbits);
+}
+
+static uint64_t rhbloom_clock(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+#define RHBLOOM_STAT_PROBE(rhbloom, len) rhbloom_stat_probe((rhbloom), (len))
+#define RHBLOOM_STAT_BLOOM(rhbloom, ntests, nbits) \
+    rhbloom_stat_bloom((rhbloom), (ntests), (nbits))
+#define RHBLOOM_STAT_UPGRADE(rhbloom) \
+    RHBLOOM_STORE_RELAXED(&(rhbloom)->upgrade_ns, \
+        rhbloom_clock(CLOCK_REALTIME))
+#define RHBLOOM_STAT_NPROBE(t, home, i) \
+    ((t)->nprobe = (((i) - (home)) & ((t)->nbuckets-1)) + 1)
+#else
+#define RHBLOOM_STAT_PROBE(rhbloom, len) ((void)0)
+#define RHBLOOM_STAT_BLOOM(rhbloom, ntests, nbits) ((void)0)
+#define RHBLOOM_STAT_UPGRADE(rhbloom) ((void)0)
+#define RHBLOOM_STAT_NPROBE(t, home, i) ((void)(home))
+#endif
 
 // dib/key entry as a uint64
 #define RHBLOOM_KEY(x) ((uint64_t)(x)<<8>>8)
 #define RHBLOOM_DIB(x) (int)((uint64_t)(x)>>56)
 #define RHBLOOM_SETKEYDIB(key,dib) (RHBLOOM_KEY((key))|((uint64_t)(dib)<<56))
 
-struct rhbloom *rhbloom_new_with_allocator(size_t n, double p, 
-    void*(*_malloc)(size_t), void(*_free)(void*))
+static bool rhbloom_testadd(struct rhbloom *rhbloom, uint64_t key, bool add);
+
+static void rhbloom_testbits(struct rhbloom *rhbloom, const uint64_t *keys,
+    size_t n, bool *out)
 {
-    if (n < 16) n = 16;
+    for (size_t i = 0; i < n; i++) {
+        out[i] = rhbloom_testadd(rhbloom, keys[i], false);
+    }
+}
+
+#ifdef RHBLOOM_X86_SIMD
+
+// The vector kernels test several keys at once, one key per lane, following
+// the exact same probe sequence as rhbloom_testadd.
+
+__attribute__((target("avx2")))
+static void rhbloom_testbits_avx2(struct rhbloom *rhbloom, 
+    const uint64_t *keys, size_t n, bool *out)
+{
+    const __m256i keymask = _mm256_set1_epi64x(RHBLOOM_KEY(UINT64_MAX));
+    const __m256i mmask = _mm256_set1_epi64x(rhbloom->m-1);
+    const __m256i pmask = _mm256_set1_epi64x(rhbloom->pmask);
+    const __m256i bmask = _mm256_set1_epi64x(63);
+    const __m256i one = _mm256_set1_epi64x(1);
+    // AVX2 has no 64-bit multiply, so it's composed of 32-bit multiplies.
+    const __m256i clo = _mm256_set1_epi64x(UINT64_C(0x94d049bb133111eb));
+    const __m256i chi = _mm256_srli_epi64(clo, 32);
+    const long long *words = (const long long*)rhbloom->bits;
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i key = _mm256_loadu_si256((const __m256i*)(keys+i));
+        key = _mm256_and_si256(key, keymask);
+        __m256i j = _mm256_and_si256(key, mmask);
+        __m256i base = _mm256_andnot_si256(pmask, j);
+        __m256i hits = one;
+        for (size_t p = 0; ; p++) {
+            __m256i w = _mm256_i64gather_epi64(words, 
+                _mm256_srli_epi64(j, 6), 8);
+            w = _mm256_srlv_epi64(w, _mm256_and_si256(j, bmask));
+            hits = _mm256_and_si256(hits, w);
+            if (p == rhbloom->k-1 || _mm256_testz_si256(hits, one)) {
+                break;
+            }
+            __m256i lo = _mm256_mul_epu32(key, clo);
+            __m256i mid = _mm256_add_epi64(
+                _mm256_mul_epu32(_mm256_srli_epi64(key, 32), clo),
+                _mm256_mul_epu32(key, chi));
+            key = _mm256_add_epi64(lo, _mm256_slli_epi64(mid, 32));
+            key = _mm256_xor_si256(key, _mm256_srli_epi64(key, 31));
+            j = _mm256_or_si256(base, _mm256_and_si256(key, pmask));
+        }
+        int mask = _mm256_movemask_pd(_mm256_castsi256_pd(
+            _mm256_slli_epi64(hits, 63)));
+        for (int l = 0; l < 4; l++) {
+            out[i+l] = (mask >> l) & 1;
+        }
+    }
+    rhbloom_testbits(rhbloom, keys+i, n-i, out+i);
+}
+
+__attribute__((target("avx512f,avx512dq")))
+static void rhbloom_testbits_avx512(struct rhbloom *rhbloom, 
+    const uint64_t *keys, size_t n, bool *out)
+{
+    const __m512i keymask = _mm512_set1_epi64(RHBLOOM_KEY(UINT64_MAX));
+    const __m512i mmask = _mm512_set1_epi64(rhbloom->m-1);
+    const __m512i pmask = _mm512_set1_epi64(rhbloom->pmask);
+    const __m512i bmask = _mm512_set1_epi64(63);
+    const __m512i one = _mm512_set1_epi64(1);
+    const __m512i c = _mm512_set1_epi64(UINT64_C(0x94d049bb133111eb));
+    const long long *words = (const long long*)rhbloom->bits;
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m512i key = _mm512_loadu_si512((const void*)(keys+i));
+        key = _mm512_and_si512(key, keymask);
+        __m512i j = _mm512_and_si512(key, mmask);
+        __m512i base = _mm512_andnot_si512(pmask, j);
+        __mmask8 hits = 0xFF;
+        for (size_t p = 0; ; p++) {
+            __m512i w = _mm512_mask_i64gather_epi64(_mm512_setzero_si512(),
+                hits, _mm512_srli_epi64(j, 6), words, 8);
+            w = _mm512_srlv_epi64(w, _mm512_and_si512(j, bmask));
+            hits = _mm512_mask_test_epi64_mask(hits, w, one);
+            if (p == rhbloom->k-1 || !hits) {
+                break;
+            }
+            key = _mm512_mullo_epi64(key, c);
+            key = _mm512_xor_si512(key, _mm512_srli_epi64(key, 31));
+            j = _mm512_or_si512(base, _mm512_and_si512(key, pmask));
+        }
+        for (int l = 0; l < 8; l++) {
+            out[i+l] = (hits >> l) & 1;
+        }
+    }
+    rhbloom_testbits(rhbloom, keys+i, n-i, out+i);
+}
+
+#endif
+
+// Pick the fastest batch kernel for the running cpu.
+static rhbloom_testbits_fn rhbloom_testbits_kernel(void) {
+#ifdef RHBLOOM_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && 
+        __builtin_cpu_supports("avx512dq"))
+    {
+        return rhbloom_testbits_avx512;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        return rhbloom_testbits_avx2;
+    }
+#endif
+    return rhbloom_testbits;
+}
+
+// Returns true if the running cpu can scan buckets with avx2.
+static bool rhbloom_scan_kernel(void) {
+#ifdef RHBLOOM_X86_SIMD
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#else
+    return false;
+#endif
+}
 
+static struct rhbloom *rhbloom_alloc(size_t k, size_t m, bool blocked, 
+    const struct rhbloom_options *opts);
+static void rhbloom_compress(struct rhbloom *rhbloom, int width);
+static void rhbloom_buckets_free(struct rhbloom *rhbloom, uint64_t *buckets);
+static void rhbloom_bits_free(struct rhbloom *rhbloom);
+static void rhbloom_untrack(struct rhbloom *rhbloom);
+
+// Calculate the bloom parameters for n keys at a false positive rate of p.
+static void rhbloom_params(size_t n, double p, bool blocked, size_t *k_out, 
+    size_t *m_out)
+{
     // Calculate the total number of bits needed
     size_t m = n * log(p) / log(1 / pow(2, log(2)));
 
@@ -51,28 +450,218 @@ struct rhbloom *rhbloom_new_with_allocator(size_t n, double p,
     while (m0 < m) {
         m0 *= 2;
     }
+    if (m0 < 64) {
+        // At least one word
+        m0 = 64;
+    }
+    if (blocked && m0 < RHBLOOM_BLOCKBITS) {
+        m0 = RHBLOOM_BLOCKBITS;
+    }
     size_t k0 = round((double)m / (double)m0 * (double)k);
-    
-    _malloc = _malloc ? _malloc : malloc;
-    _free = _free ? _free : free;
+    if (k0 < 1) {
+        k0 = 1;
+    }
+    *k_out = k0;
+    *m_out = m0;
+}
+
+/// Create a new filter using the provided options.
+/// @param n maximum number of keys that can exist in filter, or the number
+/// of keys in the first layer with opts->scalable
+/// @param p false positive rate. With opts->blocked the effective rate is
+/// higher, about 1.2x at p=0.01 and 2x at p=0.0001, because keys crowd into
+/// individual blocks unevenly.
+/// @param opts options, or NULL for defaults
+/// @return NULL if out of memory, when combining incremental, scalable,
+/// counting, or tracking with concurrent, or when combining counting or
+/// tracking with scalable or compressed with incremental
+struct rhbloom *rhbloom_new_with_options(size_t n, double p,
+    const struct rhbloom_options *opts)
+{
+    struct rhbloom_options defopts = { 0 };
+    opts = opts ? opts : &defopts;
+    if (n < 16) n = 16;
+    if (opts->scalable) {
+        // The rates of all layers add up to p.
+        p /= 2;
+    }
+    size_t k, m;
+    rhbloom_params(n, p, opts->blocked, &k, &m);
+    struct rhbloom *rhbloom = rhbloom_alloc(k, m, opts->blocked, opts);
+    if (rhbloom && opts->compressed) {
+        // Narrow slots keep 12 fingerprint bits above the home index, for
+        // false positives of around 0.01% in the hashmap phase. With 32-bit
+        // slots that's 24 bits, and hardly any.
+        rhbloom_compress(rhbloom, p >= 0.02 ? 16 : 32);
+    }
+    if (rhbloom && opts->scalable) {
+        rhbloom->scalable = true;
+        rhbloom->cap = n;
+        rhbloom->p = p;
+    }
+    return rhbloom;
+}
+
+static void *rhbloom_malloc(struct rhbloom *rhbloom, size_t size) {
+    if (rhbloom->allocator.malloc) {
+        return rhbloom->allocator.malloc(size, rhbloom->allocator.udata);
+    }
+    return rhbloom->malloc(size);
+}
+
+static void rhbloom_dealloc(struct rhbloom *rhbloom, void *ptr) {
+    if (rhbloom->allocator.free) {
+        rhbloom->allocator.free(ptr, rhbloom->allocator.udata);
+    } else {
+        rhbloom->free(ptr);
+    }
+}
+
+// Allocate an empty filter with known bloom parameters.
+static struct rhbloom *rhbloom_alloc(size_t k, size_t m, bool blocked, 
+    const struct rhbloom_options *opts)
+{
+    // Only the allocator fields of the prototype are used.
+    struct rhbloom proto;
+    proto.malloc = opts->malloc ? opts->malloc : malloc;
+    proto.free = opts->free ? opts->free : free;
+    memset(&proto.allocator, 0, sizeof(struct rhbloom_allocator));
+    if (opts->allocator) {
+        proto.allocator = *opts->allocator;
+        if (!proto.allocator.malloc || !proto.allocator.free) {
+            return 0;
+        }
+    }
+    if ((opts->incremental || opts->scalable || opts->counting) && 
+        opts->concurrent)
+    {
+        // Migrating on reads, swapping layers, and changing counters don't
+        // mix with lock-free readers.
+        return 0;
+    }
+    if ((opts->counting && opts->scalable) || 
+        (opts->compressed && opts->incremental) ||
+        (opts->tracking && (opts->concurrent || opts->scalable)))
+    {
+        // The dirty blocks and the key log are plain writes, and a new
+        // layer has no delta.
+        return 0;
+    }
+    if (opts->load_factor < 0 || opts->load_factor > RHBLOOM_MAXLOAD || 
+        opts->upgrade_ratio < 0 || 
+        (opts->compressed && opts->upgrade_ratio > 1))
+    {
+        // Compressed slots only have room for the key bits of tables up to
+        // the bloom size.
+        return 0;
+    }
 
-    struct rhbloom *rhbloom = _malloc(sizeof(struct rhbloom));
-    if (!_malloc) {
+    struct rhbloom *rhbloom = rhbloom_malloc(&proto, sizeof(struct rhbloom));
+    if (!rhbloom) {
         return 0;
     }
-    rhbloom->malloc = _malloc;
-    rhbloom->free = _free;
+    rhbloom->malloc = proto.malloc;
+    rhbloom->free = proto.free;
+    rhbloom->allocator = proto.allocator;
     rhbloom->count = 0;
     rhbloom->nbuckets = 0;
     rhbloom->buckets = 0;
-    rhbloom->k = k0;
-    rhbloom->m = m0;
+    rhbloom->load = opts->load_factor ? 
+        (size_t)(opts->load_factor * 256) : 128;
+    rhbloom->load = rhbloom->load < 1 ? 1 : rhbloom->load;
+    rhbloom->upgrade = opts->upgrade_ratio ? opts->upgrade_ratio : 1;
+    rhbloom->budget = opts->memory_budget;
+    rhbloom->k = k;
+    rhbloom->m = m;
+    rhbloom->pmask = blocked ? RHBLOOM_BLOCKBITS-1 : m-1;
+    rhbloom->counting = opts->counting;
+    rhbloom->branchless = opts->branchless;
+    rhbloom->nbits = 0;
     rhbloom->bits = 0;
+    rhbloom->bitsmem = 0;
+    rhbloom->bitsmapped = 0;
+    rhbloom->pages = opts->pages;
+    rhbloom->numa = opts->numa;
+    rhbloom->numa_node = opts->numa_node;
+    rhbloom->testbits = opts->counting ? rhbloom_testbits : 
+        rhbloom_testbits_kernel();
+    // Concurrent readers load buckets one at a time, as writers change them.
+    rhbloom->simd = !opts->concurrent && rhbloom_scan_kernel();
+    rhbloom->sync = 0;
+    rhbloom->view = false;
+    rhbloom->incremental = opts->incremental;
+    rhbloom->buckets_old = 0;
+    rhbloom->nbuckets_old = 0;
+    rhbloom->migrated = 0;
+    rhbloom->nold = 0;
+    rhbloom->fpbits = 0;
+    rhbloom->fpwidth = 64;
+    rhbloom->fpmask = UINT64_MAX;
+    rhbloom->scalable = false;
+    rhbloom->cap = 0;
+    rhbloom->p = 0;
+    rhbloom->nkeys = 0;
+    rhbloom->prev = 0;
+    rhbloom->tracking = opts->tracking;
+    rhbloom->overflow = false;
+    rhbloom->snapshot = 0;
+    rhbloom->keylog = 0;
+    rhbloom->nlog = 0;
+    rhbloom->logcap = 0;
+    rhbloom->dirty = 0;
+#ifdef RHBLOOM_STATS
+    rhbloom->counters = 0;
+    rhbloom->grows = 0;
+    rhbloom->grow_ns = 0;
+    rhbloom->upgrade_ns = 0;
+#endif
+    if (opts->concurrent) {
+#ifdef RHBLOOM_ATOMICS
+        rhbloom->sync = rhbloom_malloc(rhbloom, sizeof(struct rhbloom_sync));
+        if (!rhbloom->sync) {
+            rhbloom_dealloc(rhbloom, rhbloom);
+            return 0;
+        }
+        memset(rhbloom->sync, 0, sizeof(struct rhbloom_sync));
+        if (pthread_mutex_init(&rhbloom->sync->lock, 0)) {
+            rhbloom_dealloc(rhbloom, rhbloom->sync);
+            rhbloom_dealloc(rhbloom, rhbloom);
+            return 0;
+        }
+#else
+        // No atomics available for this compiler
+        rhbloom_dealloc(rhbloom, rhbloom);
+        return 0;
+#endif
+    }
+#ifdef RHBLOOM_STATS
+    memset(&rhbloom->counter, 0, sizeof(struct rhbloom_counters));
+    rhbloom->counters = &rhbloom->counter;
+    if (rhbloom->sync) {
+        size_t size = RHBLOOM_STRIPES * sizeof(struct rhbloom_counters);
+        rhbloom->counters = rhbloom_malloc(rhbloom, size);
+        if (!rhbloom->counters) {
+            rhbloom_free(rhbloom);
+            return 0;
+        }
+        memset(rhbloom->counters, 0, size);
+    }
+#endif
     return rhbloom;
 }
 
+struct rhbloom *rhbloom_new_with_allocator(size_t n, double p, 
+    void*(*_malloc)(size_t), void(*_free)(void*))
+{
+    struct rhbloom_options opts = { 0 };
+    opts.malloc = _malloc;
+    opts.free = _free;
+    return rhbloom_new_with_options(n, p, &opts);
+}
+
 /// Create a new filter
 /// @param n maximum number of keys that can exist in filter to 
+/// @param p false positive rate
 /// @return NULL if out of memory
 struct rhbloom *rhbloom_new(size_t n, double p) {
     return rhbloom_new_with_allocator(n, p, malloc, free);
@@ -80,19 +669,36 @@ struct rhbloom *rhbloom_new(size_t n, double p) {
 
 /// Free the filter
 void rhbloom_free(struct rhbloom *rhbloom) {
-    if (rhbloom->bits) {
-        rhbloom->free(rhbloom->bits);
+    rhbloom_untrack(rhbloom);
+    rhbloom_bits_free(rhbloom);
+    if (!rhbloom->view) {
+        rhbloom_buckets_free(rhbloom, rhbloom->buckets);
     }
-    if (rhbloom->buckets) {
-        rhbloom->free(rhbloom->buckets);
+    rhbloom_buckets_free(rhbloom, rhbloom->buckets_old);
+    if (rhbloom->prev) {
+        rhbloom_free(rhbloom->prev);
     }
+#ifdef RHBLOOM_ATOMICS
+    if (rhbloom->sync) {
+        pthread_mutex_destroy(&rhbloom->sync->lock);
+        rhbloom_dealloc(rhbloom, rhbloom->sync);
+    }
+#endif
+#ifdef RHBLOOM_STATS
+    if (rhbloom->counters && rhbloom->counters != &rhbloom->counter) {
+        rhbloom_dealloc(rhbloom, rhbloom->counters);
+    }
+#endif
     rhbloom->count = 0;
     rhbloom->nbuckets = 0;
     rhbloom->buckets = 0;
     rhbloom->bits = 0;
-    rhbloom->free(rhbloom);
+    rhbloom->bitsmem = 0;
+    rhbloom_dealloc(rhbloom, rhbloom);
 }
 
+// The mix and the probe sequence in rhbloom_testadd_bits are part of the
+// serialized format. Changing either one breaks existing filters.
 static uint64_t rhbloom_mix(uint64_t key) {
     // https://zimbry.blogspot.com/2011/09/better-bit-mixing-improving-on.html
     // hash u64 using mix13
@@ -104,162 +710,3118 @@ static uint64_t rhbloom_mix(uint64_t key) {
     return key;
 }
 
-static bool rhbloom_testadd(struct rhbloom *rhbloom, uint64_t key, bool add) {
-    // We only want the 56-bit key in order to match correcly with the
-    // robinhood entries, upon upgrade.
-    key = RHBLOOM_KEY(key);
+// Mix the key and keep the fingerprint bits of a compressed filter.
+static uint64_t rhbloom_hash(struct rhbloom *rhbloom, uint64_t key) {
+    return rhbloom_mix(key) & rhbloom->fpmask;
+}
 
-    // Add or check each bit
-    size_t i = 0;
-    size_t j = key & (rhbloom->m-1);
-    while (1) {
-        if (add) {
-            rhbloom->bits[j>>3] |= add<<(j&7);
-        } else if (!((rhbloom->bits[j>>3]>>(j&7))&1)) {
-            return false;
+// Byte keys are hashed with wyhash (final version 4).
+// https://github.com/wangyi-fudan/wyhash
+
+static void rhbloom_mum(uint64_t *a, uint64_t *b) {
+#ifdef __SIZEOF_INT128__
+    __uint128_t r = (__uint128_t)*a * *b;
+    *a = (uint64_t)r;
+    *b = (uint64_t)(r >> 64);
+#else
+    uint64_t ha = *a >> 32, hb = *b >> 32;
+    uint64_t la = (uint32_t)*a, lb = (uint32_t)*b;
+    uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+    uint64_t t = rl + (rm0 << 32);
+    uint64_t c = t < rl;
+    uint64_t lo = t + (rm1 << 32);
+    c += lo < t;
+    *a = lo;
+    *b = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+#endif
+}
+
+static uint64_t rhbloom_wymix(uint64_t a, uint64_t b) {
+    rhbloom_mum(&a, &b);
+    return a ^ b;
+}
+
+// Little-endian reads, so that the hashes are the same on every platform.
+static uint64_t rhbloom_wyr8(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+#ifdef RHBLOOM_BIG_ENDIAN
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+
+static uint64_t rhbloom_wyr4(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+#ifdef RHBLOOM_BIG_ENDIAN
+    v = __builtin_bswap32(v);
+#endif
+    return v;
+}
+
+static uint64_t rhbloom_wyr3(const uint8_t *p, size_t k) {
+    return ((uint64_t)p[0] << 16) | ((uint64_t)p[k>>1] << 8) | p[k-1];
+}
+
+static uint64_t rhbloom_wyhash(const void *data, size_t len) {
+    static const uint64_t secret[4] = {
+        UINT64_C(0x2d358dccaa6c78a5), UINT64_C(0x8bb84b93962eacc9),
+        UINT64_C(0x4b33a62ed433d4a3), UINT64_C(0x4d5a2da51de1aa47),
+    };
+    const uint8_t *p = data;
+    uint64_t seed = rhbloom_wymix(secret[0], secret[1]);
+    uint64_t a, b;
+    if (len <= 16) {
+        if (len >= 4) {
+            a = (rhbloom_wyr4(p) << 32) | rhbloom_wyr4(p + ((len >> 3) << 2));
+            b = (rhbloom_wyr4(p + len - 4) << 32) | 
+                rhbloom_wyr4(p + len - 4 - ((len >> 3) << 2));
+        } else if (len > 0) {
+            a = rhbloom_wyr3(p, len);
+            b = 0;
+        } else {
+            a = b = 0;
         }
-        if (i == rhbloom->k-1) {
-            break;
+    } else {
+        size_t i = len;
+        if (i > 48) {
+            uint64_t see1 = seed, see2 = seed;
+            do {
+                seed = rhbloom_wymix(rhbloom_wyr8(p) ^ secret[1], 
+                    rhbloom_wyr8(p + 8) ^ seed);
+                see1 = rhbloom_wymix(rhbloom_wyr8(p + 16) ^ secret[2], 
+                    rhbloom_wyr8(p + 24) ^ see1);
+                see2 = rhbloom_wymix(rhbloom_wyr8(p + 32) ^ secret[3], 
+                    rhbloom_wyr8(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= see1 ^ see2;
         }
-        // Pick the next bit. Use part of the mix13 forumula to help get a more
-        // randomized value.
-        key *= UINT64_C(0x94d049bb133111eb);
-        key ^= key >> 31;
-        j = key & (rhbloom->m-1);
-        i++;
+        while (i > 16) {
+            seed = rhbloom_wymix(rhbloom_wyr8(p) ^ secret[1], 
+                rhbloom_wyr8(p + 8) ^ seed);
+            i -= 16;
+            p += 16;
+        }
+        a = rhbloom_wyr8(p + i - 16);
+        b = rhbloom_wyr8(p + i - 8);
     }
+    a ^= secret[1];
+    b ^= seed;
+    rhbloom_mum(&a, &b);
+    return rhbloom_wymix(a ^ secret[0] ^ len, b ^ secret[1]);
+}
 
-    return true;
+// The hash of a byte key is already well mixed, and takes the place of the
+// mixed integer key.
+static uint64_t rhbloom_hash_bytes(struct rhbloom *rhbloom, const void *data, 
+    size_t len)
+{
+    return rhbloom_wyhash(data, len) & rhbloom->fpmask;
+}
+
+// Advance the key to pick the next bit. Use part of the mix13 forumula to
+// help get a more randomized value.
+static uint64_t rhbloom_next(uint64_t key) {
+    key *= UINT64_C(0x94d049bb133111eb);
+    key ^= key >> 31;
+    return key;
 }
 
-static bool rhbloom_addkey(struct rhbloom *rhbloom, uint64_t key);
+// Size in bytes of the bloom bits, or of the counters when counting.
+static size_t rhbloom_bitsize(struct rhbloom *rhbloom) {
+    return rhbloom->counting ? rhbloom->m >> 1 : rhbloom->m >> 3;
+}
 
-static bool rhbloom_grow(struct rhbloom *rhbloom) {
-    size_t nbuckets_old = rhbloom->nbuckets;
-    uint64_t *buckets_old = rhbloom->buckets;
-    size_t nbuckets_new = nbuckets_old == 0 ? 16 : nbuckets_old * 2;
-    if (nbuckets_new * 8 >= rhbloom->m >> 3) {
-        // Upgrade to bloom filter
-        rhbloom->bits = rhbloom->malloc(rhbloom->m >> 3);
-        if (!rhbloom->bits) {
-            return 0;
+// Index of the word that holds bit or counter j.
+static size_t rhbloom_word(struct rhbloom *rhbloom, size_t j) {
+    return rhbloom->counting ? j >> 4 : j >> 6;
+}
+
+// Number of delta blocks of the bloom bits. The last one may be short.
+static size_t rhbloom_nblocks(struct rhbloom *rhbloom) {
+    return (rhbloom_bitsize(rhbloom) + RHBLOOM_DELTABLOCK - 1) / 
+        RHBLOOM_DELTABLOCK;
+}
+
+// Mark the blocks that hold the bits or counters of the key as changed since
+// the snapshot. When blocked, all of them are in the block of the first.
+static void rhbloom_mark(struct rhbloom *rhbloom, uint64_t key) {
+    key = RHBLOOM_KEY(key);
+    size_t j = key & (rhbloom->m-1);
+    size_t base = j & ~rhbloom->pmask;
+    size_t k = rhbloom->pmask == rhbloom->m-1 ? rhbloom->k : 1;
+    for (size_t i = 0; i < k; i++) {
+        if (i > 0) {
+            key = rhbloom_next(key);
+            j = base | (key & rhbloom->pmask);
         }
-        memset(rhbloom->bits, 0, rhbloom->m >> 3);
-        rhbloom->count = 0;
-        rhbloom->nbuckets = 0;
-        rhbloom->buckets = 0;
-        for (size_t i = 0; i < nbuckets_old; i++) {
-            if (RHBLOOM_DIB(buckets_old[i])) {
-                rhbloom_testadd(rhbloom, buckets_old[i], true);
+        size_t block = rhbloom_word(rhbloom, j) / (RHBLOOM_DELTABLOCK/8);
+        rhbloom->dirty[block>>6] |= UINT64_C(1) << (block&63);
+    }
+}
+
+// Count the key in or out of the counters, or test it. Counter j is the
+// 4-bit nibble j&15 of word j>>4. When deleting, the counters are only
+// decremented if the key tests positive.
+// Returns false if the key tests negative. When adding, returns true if any
+// counter was zero.
+static bool rhbloom_testadd_counters(struct rhbloom *rhbloom, uint64_t *bits,
+    uint64_t key, int delta)
+{
+    key = RHBLOOM_KEY(key);
+    size_t j0 = key & (rhbloom->m-1);
+    size_t base = j0 & ~rhbloom->pmask;
+    size_t nfresh = 0;
+    size_t nstale = 0;
+    for (int pass = delta < 0 ? 0 : 1; pass < 2; pass++) {
+        uint64_t key0 = key;
+        size_t j = j0;
+        for (size_t i = 0; ; i++) {
+            int shift = (j & 15) * 4;
+            uint64_t c = (bits[j>>4] >> shift) & RHBLOOM_COUNTMAX;
+            if (pass == 0 || delta == 0) {
+                if (c == 0) {
+                    if (delta == 0) {
+                        RHBLOOM_STAT_BLOOM(rhbloom, 1, i+1);
+                    }
+                    return false;
+                }
+            } else if (delta > 0 && c < RHBLOOM_COUNTMAX) {
+                nfresh += c == 0;
+                bits[j>>4] += UINT64_C(1) << shift;
+            } else if (delta < 0 && c > 0 && c < RHBLOOM_COUNTMAX) {
+                nstale += c == 1;
+                bits[j>>4] -= UINT64_C(1) << shift;
             }
-        }
-    } else {
-        uint64_t *buckets = rhbloom->malloc(nbuckets_new << 3);
-        if (!buckets) {
-            return 0;
-        }
-        memset(buckets, 0, nbuckets_new << 3);
-        rhbloom->count = 0;
-        rhbloom->nbuckets = nbuckets_new;
-        rhbloom->buckets = buckets;
-        for (size_t i = 0; i < nbuckets_old; i++) {
-            if (RHBLOOM_DIB(buckets_old[i])) {
-                rhbloom_addkey(rhbloom, buckets_old[i]);
+            if (i == rhbloom->k-1) {
+                break;
             }
+            key0 = rhbloom_next(key0);
+            j = base | (key0 & rhbloom->pmask);
         }
     }
-    if (buckets_old) {
-        rhbloom->free(buckets_old);
+    if (delta == 0) {
+        RHBLOOM_STAT_BLOOM(rhbloom, 1, rhbloom->k);
+    } else if (rhbloom->dirty) {
+        rhbloom_mark(rhbloom, key);
     }
-    return true;
+    rhbloom->nbits = rhbloom->nbits + nfresh - nstale;
+    return delta > 0 ? nfresh > 0 : true;
 }
 
-static bool rhbloom_addkey(struct rhbloom *rhbloom, uint64_t key) {
+// Test the key by ANDing all k of its bits, with no branch on any of them.
+// An early exit saves reads on a miss, but when hits and misses are mixed
+// the branch is hard to predict, and the mispredictions cost more.
+static bool rhbloom_test_branchless(struct rhbloom *rhbloom, uint64_t *bits,
+    uint64_t key)
+{
     key = RHBLOOM_KEY(key);
-    int dib = 1;
-    size_t i = key & (rhbloom->nbuckets-1);
-    while (1) {
-        if (RHBLOOM_DIB(rhbloom->buckets[i]) == 0) {
-            rhbloom->buckets[i] = RHBLOOM_SETKEYDIB(key, dib);
-            rhbloom->count++;
-            return true;
-        }
-        if (RHBLOOM_KEY(rhbloom->buckets[i]) == key) {
-            return true;
-        }
-        if (RHBLOOM_DIB(rhbloom->buckets[i]) < dib) {
-            uint64_t tmp = rhbloom->buckets[i];
-            rhbloom->buckets[i] = RHBLOOM_SETKEYDIB(key, dib);
-            key = RHBLOOM_KEY(tmp);
-            dib = RHBLOOM_DIB(tmp);
-        }
-        dib++;
-        i = (i + 1) & (rhbloom->nbuckets-1);
+    size_t j = key & (rhbloom->m-1);
+    size_t base = j & ~rhbloom->pmask;
+    uint64_t hits = RHBLOOM_LOAD_RELAXED(&bits[j>>6]) >> (j&63);
+    for (size_t i = 1; i < rhbloom->k; i++) {
+        key = rhbloom_next(key);
+        j = base | (key & rhbloom->pmask);
+        hits &= RHBLOOM_LOAD_RELAXED(&bits[j>>6]) >> (j&63);
     }
+    RHBLOOM_STAT_BLOOM(rhbloom, 1, rhbloom->k);
+    return hits & 1;
 }
 
-/// Adds a key to the filter.
-/// @return true if key was added or false if out of memory 
-bool rhbloom_add(struct rhbloom *rhbloom, uint64_t key) {
-    key = rhbloom_mix(key);
+// Add or test the key. When adding, returns true if any bit was not yet set.
+static bool rhbloom_testadd_bits(struct rhbloom *rhbloom, uint64_t *bits,
+    uint64_t key, bool add)
+{
+    if (rhbloom->counting) {
+        return rhbloom_testadd_counters(rhbloom, bits, key, add);
+    }
+    if (!add && rhbloom->branchless) {
+        return rhbloom_test_branchless(rhbloom, bits, key);
+    }
+    // We only want the 56-bit key in order to match correcly with the
+    // robinhood entries, upon upgrade.
+    key = RHBLOOM_KEY(key);
+    uint64_t key0 = key;
+
+    // Add or check each bit. When blocked, the first bit picks the block and
+    // the rest land inside of it.
+    size_t i = 0;
+    size_t j = key & (rhbloom->m-1);
+    size_t base = j & ~rhbloom->pmask;
+    size_t stripe = (key >> 4) & (RHBLOOM_STRIPES-1);
+    size_t nfresh = 0;
     while (1) {
-        if (rhbloom->bits) {
-            rhbloom_testadd(rhbloom, key, true);
+        uint64_t bit = UINT64_C(1)<<(j&63);
+        if (add) {
+            if (rhbloom->sync) {
+                nfresh += !(RHBLOOM_OR_RELAXED(&bits[j>>6], bit)&bit);
+            } else {
+                nfresh += !(bits[j>>6]&bit);
+                bits[j>>6] |= bit;
+            }
+        } else if (!(RHBLOOM_LOAD_RELAXED(&bits[j>>6])&bit)) {
+            RHBLOOM_STAT_BLOOM(rhbloom, 1, i+1);
+            return false;
+        }
+        if (i == rhbloom->k-1) {
+            break;
+        }
+        key = rhbloom_next(key);
+        j = base | (key & rhbloom->pmask);
+        i++;
+    }
+    if (!add) {
+        RHBLOOM_STAT_BLOOM(rhbloom, 1, i+1);
+        return true;
+    }
+    if (nfresh) {
+#ifdef RHBLOOM_ATOMICS
+        if (rhbloom->sync) {
+            RHBLOOM_ADD_RELAXED(&rhbloom->sync->stripes[stripe].nbits, nfresh);
             return true;
         }
-        if (rhbloom->count == rhbloom->nbuckets >> 1) {
-            if (!rhbloom_grow(rhbloom)) {
-                return false;
-            }
-            continue;
+#endif
+        rhbloom->nbits += nfresh;
+        if (rhbloom->dirty) {
+            rhbloom_mark(rhbloom, key0);
         }
-        break;
     }
-    return rhbloom_addkey(rhbloom, key);
+    (void)stripe;
+    return nfresh > 0;
 }
 
-/// Check if key probably exists in filter.
-/// @return true if probably exists or false if not exists
-bool rhbloom_test(struct rhbloom *rhbloom, uint64_t key) {
-    key = rhbloom_mix(key);
-    if (rhbloom->bits) {
-        return rhbloom_testadd(rhbloom, key, false);
-    }
-    if (!rhbloom->buckets) {
-        return false;
+static bool rhbloom_testadd(struct rhbloom *rhbloom, uint64_t key, bool add) {
+    return rhbloom_testadd_bits(rhbloom, rhbloom->bits, key, add);
+}
+
+static size_t rhbloom_popcount(uint64_t x) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_popcountll(x);
+#else
+    size_t n = 0;
+    for (; x; x &= x-1) {
+        n++;
     }
-    key = RHBLOOM_KEY(key);
-    int dib = 1;
-    size_t i = key & (rhbloom->nbuckets-1);
-    while (1) {
-        bool yes = RHBLOOM_KEY(rhbloom->buckets[i]) == key;
-        bool no = RHBLOOM_DIB(rhbloom->buckets[i]) < dib;
-        if (yes || no) {
-            return yes;
+    return n;
+#endif
+}
+
+// Count the set bits, or the nonzero counters, of n bloom words.
+static size_t rhbloom_countwords(struct rhbloom *rhbloom, const uint64_t *words,
+    size_t n)
+{
+    size_t nbits = 0;
+    for (size_t i = 0; i < n; i++) {
+        uint64_t w = words[i];
+        if (rhbloom->counting) {
+            w = (w | w >> 1 | w >> 2 | w >> 3) & UINT64_C(0x1111111111111111);
         }
-        dib++;
-        i = (i + 1) & (rhbloom->nbuckets-1);
+        nbits += rhbloom_popcount(w);
     }
+    return nbits;
 }
 
-/// Get the memory size in bytes of this filter.
-size_t rhbloom_memsize(struct rhbloom *rhbloom) {
-    size_t size = sizeof(struct rhbloom);
-    size += rhbloom->bits ? rhbloom->m >> 3 : rhbloom->nbuckets << 3;
-    return size;
+static size_t rhbloom_countbits(struct rhbloom *rhbloom) {
+    return rhbloom_countwords(rhbloom, rhbloom->bits, 
+        rhbloom_bitsize(rhbloom) >> 3);
 }
 
-/// Returns true if been upgraded to a bloom filter
-bool rhbloom_upgraded(struct rhbloom *rhbloom) {
-    return !!rhbloom->bits;
+// Recount the set bits after the bloom words were replaced wholesale.
+static void rhbloom_recount(struct rhbloom *rhbloom) {
+    rhbloom->nbits = rhbloom->bits ? rhbloom_countbits(rhbloom) : 0;
+#ifdef RHBLOOM_ATOMICS
+    if (rhbloom->sync) {
+        for (int i = 0; i < RHBLOOM_STRIPES; i++) {
+            rhbloom->sync->stripes[i].nbits = 0;
+        }
+    }
+#endif
 }
 
-/// Clear all entries in the filter without freeing resources.
-void rhbloom_clear(struct rhbloom *rhbloom) {
-    if (rhbloom->bits) {
-        memset(rhbloom->bits, 0, rhbloom->m >> 3);
-    } else if (rhbloom->buckets) {
-        memset(rhbloom->buckets, 0, rhbloom->nbuckets << 3);
+// Number of set bits, or nonzero counters. Views don't track them, and are
+// counted on each call.
+static size_t rhbloom_nbits(struct rhbloom *rhbloom) {
+    if (rhbloom->view) {
+        return rhbloom->bits ? rhbloom_countbits(rhbloom) : 0;
+    }
+    size_t nbits = rhbloom->nbits;
+#ifdef RHBLOOM_ATOMICS
+    if (rhbloom->sync) {
+        for (int i = 0; i < RHBLOOM_STRIPES; i++) {
+            nbits += RHBLOOM_LOAD_RELAXED(&rhbloom->sync->stripes[i].nbits);
+        }
+    }
+#endif
+    return nbits;
+}
+
+// A hashtable of buckets. The buckets are dib/key entries as u64s, unless
+// the filter is compressed. Then the larger tables keep narrow slots that
+// pack a dib and only the key bits above the home index, since the home is
+// implied by the position and the dib.
+struct rhbloom_table {
+    uint64_t *buckets;  // u64 entries, or the words that hold the slots
+    size_t nbuckets;    // number of buckets
+    int width;          // slot width in bits, 16, 32, or 64
+    int shift;          // number of key bits implied by the home index
+    bool simd;          // scan four buckets at a time
+#ifdef RHBLOOM_STATS
+    size_t nprobe;      // buckets visited by the last insert
+#endif
+};
+
+// Log2 of a power of two.
+static int rhbloom_log2(size_t n) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctzll(n);
+#else
+    int shift = 0;
+    while (((size_t)1 << shift) < n) {
+        shift++;
+    }
+    return shift;
+#endif
+}
+
+// Number of dib bits in a slot of the given width.
+static int rhbloom_dibbits(int width) {
+    return width == 16 ? 4 : 8;
+}
+
+// Width of the slots for a table of nbuckets. That's the narrowest slot
+// that holds all of the fingerprint bits which the home index does not.
+static int rhbloom_slotbits_for(int fpbits, int fpwidth, size_t nbuckets) {
+    if (!fpbits) {
+        return 64;
+    }
+    int shift = rhbloom_log2(nbuckets);
+    for (int width = fpwidth; width < 64; width *= 2) {
+        if (width - rhbloom_dibbits(width) >= fpbits - shift) {
+            return width;
+        }
+    }
+    return 64;
+}
+
+static int rhbloom_slotbits(struct rhbloom *rhbloom, size_t nbuckets) {
+    return rhbloom_slotbits_for(rhbloom->fpbits, rhbloom->fpwidth, nbuckets);
+}
+
+// Number of fingerprint bits for a compressed filter whose largest table has
+// slots of the given width, and that upgrades to bitsize bytes of bits.
+// That's the home index of the largest table plus the bits in its slots.
+// Returns 0 if there is no room for a compressed table.
+static int rhbloom_fingerprint(size_t bitsize, int width) {
+    size_t nbuckets = 16;
+    if (nbuckets * width / 8 >= bitsize) {
+        return 0;
+    }
+    while (nbuckets * 2 * width / 8 < bitsize) {
+        nbuckets *= 2;
+    }
+    int fpbits = rhbloom_log2(nbuckets) + width - rhbloom_dibbits(width);
+    return fpbits <= 56 ? fpbits : 0;
+}
+
+// Turn on compression for an empty filter.
+static void rhbloom_compress(struct rhbloom *rhbloom, int width) {
+    rhbloom->fpbits = rhbloom_fingerprint(rhbloom_bitsize(rhbloom), width);
+    if (rhbloom->fpbits) {
+        rhbloom->fpwidth = width;
+        rhbloom->fpmask = (UINT64_C(1) << rhbloom->fpbits) - 1;
+    }
+}
+
+static struct rhbloom_table rhbloom_table(struct rhbloom *rhbloom, 
+    uint64_t *buckets, size_t nbuckets)
+{
+    struct rhbloom_table t = { .buckets = buckets, .nbuckets = nbuckets, 
+        .width = 64 };
+    if (rhbloom->fpbits && nbuckets) {
+        t.width = rhbloom_slotbits(rhbloom, nbuckets);
+        t.shift = rhbloom_log2(nbuckets);
+    }
+    t.simd = rhbloom->simd && t.width == 64;
+    return t;
+}
+
+// Size in bytes of the buckets of a table.
+static size_t rhbloom_tablesize(struct rhbloom *rhbloom, size_t nbuckets) {
+    return nbuckets * rhbloom_slotbits(rhbloom, nbuckets) / 8;
+}
+
+// Get bucket i as a dib/key entry.
+static uint64_t rhbloom_get(const struct rhbloom_table *t, size_t i) {
+    if (t->width == 64) {
+        return RHBLOOM_LOAD_RELAXED(&t->buckets[i]);
+    }
+    int per = 64 / t->width;
+    int rbits = t->width - rhbloom_dibbits(t->width);
+    uint64_t word = RHBLOOM_LOAD_RELAXED(&t->buckets[i/per]);
+    uint64_t slot = (word >> (i%per*t->width)) & 
+        ((UINT64_C(1) << t->width) - 1);
+    uint64_t dib = slot >> rbits;
+    if (!dib) {
+        return 0;
+    }
+    uint64_t home = (i - (dib-1)) & (t->nbuckets-1);
+    uint64_t rem = slot & ((UINT64_C(1) << rbits) - 1);
+    return RHBLOOM_SETKEYDIB(home | rem << t->shift, dib);
+}
+
+// Set bucket i to a dib/key entry.
+// The stores are atomic to match the loads of rhbloom_get, which readers of a
+// concurrent filter make while a writer is inside the seqlock.
+static void rhbloom_set(struct rhbloom_table *t, size_t i, uint64_t entry) {
+    if (t->width == 64) {
+        RHBLOOM_STORE_RELAXED(&t->buckets[i], entry);
+        return;
+    }
+    int per = 64 / t->width;
+    int rbits = t->width - rhbloom_dibbits(t->width);
+    uint64_t slot = 0;
+    if (entry) {
+        slot = (RHBLOOM_KEY(entry) >> t->shift) | 
+            (uint64_t)RHBLOOM_DIB(entry) << rbits;
+    }
+    int off = i%per*t->width;
+    uint64_t mask = ((UINT64_C(1) << t->width) - 1) << off;
+    uint64_t word = t->buckets[i/per];
+    RHBLOOM_STORE_RELAXED(&t->buckets[i/per], (word & ~mask) | slot << off);
+}
+
+// Returns false if inserting the key would move any entry further from its
+// home than the dib bits of a narrow slot can hold.
+static bool rhbloom_fits(const struct rhbloom_table *t, uint64_t key) {
+    int maxdib = (1 << rhbloom_dibbits(t->width)) - 1;
+    int dib = 1;
+    size_t i = key & (t->nbuckets-1);
+    while (1) {
+        if (dib > maxdib) {
+            return false;
+        }
+        uint64_t entry = rhbloom_get(t, i);
+        if (RHBLOOM_DIB(entry) == 0 || RHBLOOM_KEY(entry) == key) {
+            return true;
+        }
+        if (RHBLOOM_DIB(entry) < dib) {
+            dib = RHBLOOM_DIB(entry);
+        }
+        dib++;
+        i = (i + 1) & (t->nbuckets-1);
+    }
+}
+
+// Inserts the key into the buckets.
+// Returns 1 if inserted, 0 if it already exists, or -1 if it doesn't fit
+// into the narrow slots. Nothing changes when it doesn't fit.
+#ifdef RHBLOOM_X86_SIMD
+// Scan four 64-bit buckets per step, one per lane, for the first one that
+// matches the key or ends the probe. Steps that would run past the end of
+// the buckets are taken one bucket at a time, until the probe wraps around.
+__attribute__((target("avx2")))
+static size_t rhbloom_scan_avx2(const uint64_t *buckets, size_t nbuckets,
+    uint64_t key, size_t i, int *dib)
+{
+    const __m256i keymask = _mm256_set1_epi64x(RHBLOOM_KEY(UINT64_MAX));
+    const __m256i ramp = _mm256_setr_epi64x(0, 1, 2, 3);
+    const __m256i vkey = _mm256_set1_epi64x(key);
+    int d = *dib;
+    while (1) {
+        if (i + 4 <= nbuckets) {
+            __m256i b = _mm256_loadu_si256((const __m256i*)(buckets+i));
+            __m256i dibs = _mm256_add_epi64(_mm256_set1_epi64x(d), ramp);
+            __m256i yes = _mm256_cmpeq_epi64(_mm256_and_si256(b, keymask), 
+                vkey);
+            __m256i no = _mm256_cmpgt_epi64(dibs, _mm256_srli_epi64(b, 56));
+            int mask = _mm256_movemask_pd(_mm256_castsi256_pd(
+                _mm256_or_si256(yes, no)));
+            if (mask) {
+                int l = __builtin_ctz(mask);
+                *dib = d + l;
+                return i + l;
+            }
+            i = (i + 4) & (nbuckets-1);
+            d += 4;
+        } else {
+            uint64_t entry = buckets[i];
+            if (RHBLOOM_KEY(entry) == key || RHBLOOM_DIB(entry) < d) {
+                *dib = d;
+                return i;
+            }
+            i = (i + 1) & (nbuckets-1);
+            d++;
+        }
+    }
+}
+#endif
+
+// Returns the first bucket from i on that holds the key, or that ends the
+// probe for it, being empty or closer to its own home than the key would
+// be. The dib of bucket i is advanced along to the returned bucket.
+static size_t rhbloom_scan(const struct rhbloom_table *t, uint64_t key, 
+    size_t i, int *dib)
+{
+#ifdef RHBLOOM_X86_SIMD
+    if (t->simd) {
+        return rhbloom_scan_avx2(t->buckets, t->nbuckets, key, i, dib);
+    }
+#endif
+    while (1) {
+        uint64_t entry = rhbloom_get(t, i);
+        if (RHBLOOM_KEY(entry) == key || RHBLOOM_DIB(entry) < *dib) {
+            return i;
+        }
+        (*dib)++;
+        i = (i + 1) & (t->nbuckets-1);
+    }
+}
+
+static int rhbloom_insert(struct rhbloom_table *t, uint64_t key) {
+    key = RHBLOOM_KEY(key);
+    if (t->width < 64 && !rhbloom_fits(t, key)) {
+        return -1;
+    }
+    int dib = 1;
+    size_t i = key & (t->nbuckets-1);
+    size_t home = i;
+    // Skip the buckets that stay put, then place the key and carry the
+    // entries that it displaces.
+    i = rhbloom_scan(t, key, i, &dib);
+    while (1) {
+        uint64_t entry = rhbloom_get(t, i);
+        if (RHBLOOM_DIB(entry) == 0) {
+            rhbloom_set(t, i, RHBLOOM_SETKEYDIB(key, dib));
+            RHBLOOM_STAT_NPROBE(t, home, i);
+            return 1;
+        }
+        if (RHBLOOM_KEY(entry) == key) {
+            RHBLOOM_STAT_NPROBE(t, home, i);
+            return 0;
+        }
+        if (RHBLOOM_DIB(entry) < dib) {
+            rhbloom_set(t, i, RHBLOOM_SETKEYDIB(key, dib));
+            key = RHBLOOM_KEY(entry);
+            dib = RHBLOOM_DIB(entry);
+        }
+        dib++;
+        i = (i + 1) & (t->nbuckets-1);
+    }
+}
+
+// Removes the key from the buckets, shifting the following entries back.
+// Returns true if removed or false if it does not exist.
+static bool rhbloom_remove(struct rhbloom_table *t, uint64_t key) {
+    key = RHBLOOM_KEY(key);
+    int dib = 1;
+    size_t i = rhbloom_scan(t, key, key & (t->nbuckets-1), &dib);
+    if (RHBLOOM_DIB(rhbloom_get(t, i)) < dib) {
+        return false;
+    }
+    while (1) {
+        size_t next = (i + 1) & (t->nbuckets-1);
+        uint64_t entry = rhbloom_get(t, next);
+        if (RHBLOOM_DIB(entry) <= 1) {
+            rhbloom_set(t, i, 0);
+            return true;
+        }
+        rhbloom_set(t, i, RHBLOOM_SETKEYDIB(entry, RHBLOOM_DIB(entry)-1));
+        i = next;
+    }
+}
+
+// Stop tracking changes until the next delta, which then has to be full.
+static void rhbloom_untrack(struct rhbloom *rhbloom) {
+    rhbloom->overflow = true;
+    if (rhbloom->keylog) {
+        rhbloom_dealloc(rhbloom, rhbloom->keylog);
+    }
+    if (rhbloom->dirty) {
+        rhbloom_dealloc(rhbloom, rhbloom->dirty);
+    }
+    rhbloom->keylog = 0;
+    rhbloom->nlog = 0;
+    rhbloom->logcap = 0;
+    rhbloom->dirty = 0;
+}
+
+// Log a key that was added to the hashmap. Once the log would outgrow the
+// table, a full delta is smaller, and the log is dropped.
+static void rhbloom_log(struct rhbloom *rhbloom, uint64_t key) {
+    if (rhbloom->overflow) {
+        return;
+    }
+    if (rhbloom->nlog == rhbloom->logcap) {
+        size_t cap = rhbloom->logcap ? rhbloom->logcap * 2 : 16;
+        uint64_t *keylog = 0;
+        if (cap * 8 <= rhbloom_tablesize(rhbloom, rhbloom->nbuckets)) {
+            keylog = rhbloom_malloc(rhbloom, cap * 8);
+        }
+        if (!keylog) {
+            rhbloom_untrack(rhbloom);
+            return;
+        }
+        if (rhbloom->keylog) {
+            memcpy(keylog, rhbloom->keylog, rhbloom->nlog * 8);
+            rhbloom_dealloc(rhbloom, rhbloom->keylog);
+        }
+        rhbloom->keylog = keylog;
+        rhbloom->logcap = cap;
+    }
+    rhbloom->keylog[rhbloom->nlog++] = key;
+}
+
+// Returns false if the key doesn't fit into the narrow slots.
+static bool rhbloom_addkey(struct rhbloom *rhbloom, uint64_t key) {
+    struct rhbloom_table t = rhbloom_table(rhbloom, rhbloom->buckets, 
+        rhbloom->nbuckets);
+    int res = rhbloom_insert(&t, key);
+    if (res < 0) {
+        return false;
+    }
+    RHBLOOM_STAT_PROBE(rhbloom, t.nprobe);
+    rhbloom->count += res;
+    if (res && rhbloom->tracking) {
+        rhbloom_log(rhbloom, key);
+    }
+    return true;
+}
+
+// Returns zeroed memory, or NULL if out of memory.
+// With the stdlib allocator this is calloc, which hands out large blocks as
+// fresh pages from the system that are already zero. Those pages are only
+// touched once they're used, instead of all at once by a memset.
+static void *rhbloom_zalloc(struct rhbloom *rhbloom, size_t size) {
+    if (!rhbloom->allocator.malloc && rhbloom->malloc == malloc && 
+        rhbloom->free == free)
+    {
+        return calloc(1, size);
+    }
+    void *ptr = rhbloom_malloc(rhbloom, size);
+    if (ptr) {
+        memset(ptr, 0, size);
+    }
+    return ptr;
+}
+
+// Returns zeroed buckets, or NULL if out of memory. A table that fits goes
+// into the inline buckets, unless they're still in use.
+static uint64_t *rhbloom_buckets_alloc(struct rhbloom *rhbloom, size_t size) {
+    if (size <= sizeof(rhbloom->small) && rhbloom->buckets != rhbloom->small &&
+        rhbloom->buckets_old != rhbloom->small)
+    {
+        memset(rhbloom->small, 0, sizeof(rhbloom->small));
+        return rhbloom->small;
+    }
+    return rhbloom_zalloc(rhbloom, size);
+}
+
+static void rhbloom_buckets_free(struct rhbloom *rhbloom, uint64_t *buckets) {
+    if (buckets && buckets != rhbloom->small) {
+        rhbloom_dealloc(rhbloom, buckets);
+    }
+}
+
+#ifdef RHBLOOM_MMAP
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#define RHBLOOM_MPOL_BIND 2
+#define RHBLOOM_MPOL_INTERLEAVE 3
+
+// Map size bytes of anonymous memory, with huge pages of 2^shift bytes when
+// shift is not zero. Returns NULL if that fails.
+static void *rhbloom_map(size_t size, int shift, size_t *len) {
+    size_t pagesize = shift ? (size_t)1 << shift : 
+        (size_t)sysconf(_SC_PAGESIZE);
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    if (shift) {
+#ifdef MAP_HUGETLB
+        flags |= MAP_HUGETLB | (shift << MAP_HUGE_SHIFT);
+#else
+        return 0;
+#endif
+    }
+    *len = (size + pagesize - 1) & ~(pagesize - 1);
+    void *mem = mmap(0, *len, PROT_READ | PROT_WRITE, flags, -1, 0);
+    return mem == MAP_FAILED ? 0 : mem;
+}
+#endif
+
+// Map the bloom bits with the huge pages and numa policy of the filter,
+// trying the largest pages first. Reserved huge pages are only used for bits
+// of at least one page. Returns NULL when the filter asks for neither, or
+// when mapping fails, and the allocator is used instead.
+static void *rhbloom_bits_map(struct rhbloom *rhbloom, size_t size, 
+    size_t *len)
+{
+#ifdef RHBLOOM_MMAP
+    if (rhbloom->pages == RHBLOOM_PAGES_DEFAULT && 
+        rhbloom->numa == RHBLOOM_NUMA_DEFAULT)
+    {
+        return 0;
+    }
+    void *mem = 0;
+    if (rhbloom->pages == RHBLOOM_PAGES_1GB && size >= (size_t)1 << 30) {
+        mem = rhbloom_map(size, 30, len);
+    }
+    if (!mem && rhbloom->pages >= RHBLOOM_PAGES_2MB && size >= 1 << 21) {
+        mem = rhbloom_map(size, 21, len);
+    }
+    if (!mem) {
+        mem = rhbloom_map(size, 0, len);
+        if (!mem) {
+            return 0;
+        }
+#ifdef MADV_HUGEPAGE
+        if (rhbloom->pages != RHBLOOM_PAGES_DEFAULT) {
+            madvise(mem, *len, MADV_HUGEPAGE);
+        }
+#endif
+    }
+#ifdef SYS_mbind
+    // The policy applies to the pages as they're first touched. It's a hint,
+    // and a failure leaves the default policy in place.
+    if (rhbloom->numa != RHBLOOM_NUMA_DEFAULT) {
+        unsigned long nodes = ~0UL;
+        int mode = RHBLOOM_MPOL_INTERLEAVE;
+        if (rhbloom->numa == RHBLOOM_NUMA_BIND) {
+            nodes = 1UL << (rhbloom->numa_node & 63);
+            mode = RHBLOOM_MPOL_BIND;
+        }
+        syscall(SYS_mbind, mem, *len, mode, &nodes, sizeof(nodes)*8, 0);
+    }
+#endif
+    return mem;
+#else
+    (void)rhbloom, (void)size, (void)len;
+    return 0;
+#endif
+}
+
+// Returns zeroed bloom bits, or NULL if out of memory.
+static uint64_t *rhbloom_bits_alloc(struct rhbloom *rhbloom, void **bitsmem) {
+    size_t size = rhbloom_bitsize(rhbloom);
+    size_t len = 0;
+    if ((*bitsmem = rhbloom_bits_map(rhbloom, size, &len))) {
+        // Mapped memory is zero and page aligned.
+        rhbloom->bitsmapped = len;
+        return *bitsmem;
+    }
+    rhbloom->bitsmapped = 0;
+    *bitsmem = rhbloom_zalloc(rhbloom, size + RHBLOOM_ALIGN);
+    if (!*bitsmem) {
+        return 0;
+    }
+    return (uint64_t*)(((uintptr_t)*bitsmem + RHBLOOM_ALIGN - 1) & 
+        ~(uintptr_t)(RHBLOOM_ALIGN - 1));
+}
+
+// Zero the bloom bits. Mapped bits hand their pages back with
+// MADV_DONTNEED, and the system zeroes them as they're touched again. With
+// huge pages that drops a few pages rather than writing every byte, and the
+// memory isn't resident until it's used.
+static void rhbloom_bits_zero(struct rhbloom *rhbloom) {
+#if defined(RHBLOOM_MMAP) && defined(MADV_DONTNEED)
+    if (rhbloom->bitsmapped && 
+        !madvise(rhbloom->bitsmem, rhbloom->bitsmapped, MADV_DONTNEED))
+    {
+        return;
+    }
+#endif
+    memset(rhbloom->bits, 0, rhbloom_bitsize(rhbloom));
+}
+
+static void rhbloom_bits_free(struct rhbloom *rhbloom) {
+    if (!rhbloom->bitsmem) {
+        return;
+    }
+#ifdef RHBLOOM_MMAP
+    if (rhbloom->bitsmapped) {
+        munmap(rhbloom->bitsmem, rhbloom->bitsmapped);
+    } else
+#endif
+    {
+        rhbloom_dealloc(rhbloom, rhbloom->bitsmem);
+    }
+    rhbloom->bitsmem = 0;
+    rhbloom->bitsmapped = 0;
+}
+
+// Begin and end a change to the buckets that readers may observe.
+static void rhbloom_write_begin(struct rhbloom *rhbloom) {
+#ifdef RHBLOOM_ATOMICS
+    if (rhbloom->sync) {
+        RHBLOOM_STORE_RELAXED(&rhbloom->sync->seq, rhbloom->sync->seq+1);
+        RHBLOOM_FENCE_RELEASE();
+    }
+#endif
+    (void)rhbloom;
+}
+
+static void rhbloom_write_end(struct rhbloom *rhbloom) {
+#ifdef RHBLOOM_ATOMICS
+    if (rhbloom->sync) {
+        RHBLOOM_STORE_RELEASE(&rhbloom->sync->seq, rhbloom->sync->seq+1);
+    }
+#endif
+    (void)rhbloom;
+}
+
+// Wait until no reader can still be looking at replaced buckets.
+static void rhbloom_synchronize(struct rhbloom *rhbloom) {
+#ifdef RHBLOOM_ATOMICS
+    if (rhbloom->sync) {
+        struct rhbloom_sync *sync = rhbloom->sync;
+        size_t epoch = sync->epoch;
+        RHBLOOM_STORE_RELEASE(&sync->epoch, epoch+1);
+        RHBLOOM_FENCE_SEQCST();
+        for (int i = 0; i < RHBLOOM_STRIPES; i++) {
+            while (RHBLOOM_LOAD_ACQUIRE(&sync->stripes[i].readers[epoch&1])) {
+                sched_yield();
+            }
+        }
+    }
+#endif
+    (void)rhbloom;
+}
+
+// Upgrade to bloom filter, replaying the keys from the buckets.
+static bool rhbloom_upgrade(struct rhbloom *rhbloom) {
+    size_t nbuckets_old = rhbloom->nbuckets;
+    uint64_t *buckets_old = rhbloom->buckets;
+    void *bitsmem;
+    uint64_t *bits = rhbloom_bits_alloc(rhbloom, &bitsmem);
+    if (!bits) {
+        return false;
+    }
+    struct rhbloom_table old = rhbloom_table(rhbloom, buckets_old, 
+        nbuckets_old);
+    for (size_t i = 0; i < nbuckets_old; i++) {
+        uint64_t entry = rhbloom_get(&old, i);
+        if (RHBLOOM_DIB(entry)) {
+            rhbloom_testadd_bits(rhbloom, bits, entry, true);
+        }
+    }
+    rhbloom->nkeys = rhbloom->count;
+    rhbloom->bitsmem = bitsmem;
+    rhbloom_untrack(rhbloom);
+    RHBLOOM_STAT_UPGRADE(rhbloom);
+    RHBLOOM_STORE_RELEASE(&rhbloom->bits, bits);
+    rhbloom_synchronize(rhbloom);
+    rhbloom->count = 0;
+    rhbloom->nbuckets = 0;
+    rhbloom->buckets = 0;
+    rhbloom_buckets_free(rhbloom, buckets_old);
+    return true;
+}
+
+// Move the keys into a new set of buckets. Upgrades instead when the keys
+// don't fit into narrow slots.
+static bool rhbloom_rehash(struct rhbloom *rhbloom, size_t nbuckets_new) {
+    size_t nbuckets_old = rhbloom->nbuckets;
+    uint64_t *buckets_old = rhbloom->buckets;
+    uint64_t *buckets = rhbloom_buckets_alloc(rhbloom, 
+        rhbloom_tablesize(rhbloom, nbuckets_new));
+    if (!buckets) {
+        return false;
+    }
+    struct rhbloom_table old = rhbloom_table(rhbloom, buckets_old, 
+        nbuckets_old);
+    struct rhbloom_table t = rhbloom_table(rhbloom, buckets, nbuckets_new);
+    size_t count = 0;
+    for (size_t i = 0; i < nbuckets_old; i++) {
+        uint64_t entry = rhbloom_get(&old, i);
+        if (RHBLOOM_DIB(entry)) {
+            int res = rhbloom_insert(&t, entry);
+            if (res < 0) {
+                rhbloom_buckets_free(rhbloom, buckets);
+                return rhbloom_upgrade(rhbloom);
+            }
+            count += res;
+        }
+    }
+    // Concurrent readers load these without the lock, nbuckets first. A
+    // reader that sees the new size also sees the new, filled buckets.
+    rhbloom_write_begin(rhbloom);
+    rhbloom->count = count;
+    RHBLOOM_STORE_RELEASE(&rhbloom->buckets, buckets);
+    RHBLOOM_STORE_RELEASE(&rhbloom->nbuckets, nbuckets_new);
+    rhbloom_write_end(rhbloom);
+    rhbloom_synchronize(rhbloom);
+    rhbloom_buckets_free(rhbloom, buckets_old);
+    return true;
+}
+
+// Move up to n old buckets into the new buckets or bits. The old buckets are
+// freed once all have moved. Incremental filters are never compressed, so
+// the keys always fit.
+static void rhbloom_migrate(struct rhbloom *rhbloom, size_t n) {
+    uint64_t *old = rhbloom->buckets_old;
+    struct rhbloom_table t = rhbloom_table(rhbloom, rhbloom->buckets, 
+        rhbloom->nbuckets);
+    size_t i = rhbloom->migrated;
+    size_t end = rhbloom->nbuckets_old - i < n ? rhbloom->nbuckets_old : i + n;
+    for (; i < end; i++) {
+        if (!RHBLOOM_DIB(old[i])) {
+            continue;
+        }
+        rhbloom->nold--;
+        if (rhbloom->bits) {
+            rhbloom->nkeys += rhbloom_testadd(rhbloom, old[i], true);
+        } else {
+            rhbloom->count += rhbloom_insert(&t, old[i]);
+        }
+    }
+    rhbloom->migrated = end;
+    if (end == rhbloom->nbuckets_old) {
+        rhbloom_buckets_free(rhbloom, old);
+        rhbloom->buckets_old = 0;
+        rhbloom->nbuckets_old = 0;
+        rhbloom->migrated = 0;
+    }
+}
+
+// Finish any migration that is in progress.
+static void rhbloom_migrate_all(struct rhbloom *rhbloom) {
+    if (rhbloom->buckets_old) {
+        rhbloom_migrate(rhbloom, rhbloom->nbuckets_old);
+    }
+}
+
+// Swap in new buckets or bits and leave the old buckets to be migrated by
+// the following operations. While migrating, keys are looked for in both.
+static bool rhbloom_grow_incremental(struct rhbloom *rhbloom, 
+    size_t nbuckets_new, bool upgrade)
+{
+    uint64_t *buckets = 0;
+    uint64_t *bits = 0;
+    void *bitsmem = 0;
+    if (upgrade) {
+        bits = rhbloom_bits_alloc(rhbloom, &bitsmem);
+    } else {
+        buckets = rhbloom_buckets_alloc(rhbloom, nbuckets_new << 3);
+    }
+    if (!bits && !buckets) {
+        return false;
+    }
+    rhbloom->buckets_old = rhbloom->buckets;
+    rhbloom->nbuckets_old = rhbloom->nbuckets;
+    rhbloom->migrated = 0;
+    rhbloom->nold = rhbloom->count;
+    rhbloom->count = 0;
+    rhbloom->nbuckets = upgrade ? 0 : nbuckets_new;
+    rhbloom->buckets = buckets;
+    rhbloom->bits = bits;
+    rhbloom->bitsmem = bitsmem;
+    rhbloom->nkeys = 0;
+    if (upgrade) {
+        rhbloom_untrack(rhbloom);
+        RHBLOOM_STAT_UPGRADE(rhbloom);
+    }
+    return true;
+}
+
+// Number of keys that a table of nbuckets holds before growing.
+static size_t rhbloom_maxcount(struct rhbloom *rhbloom, size_t nbuckets) {
+    return (nbuckets >> 8) * rhbloom->load + 
+        ((nbuckets & 255) * rhbloom->load >> 8);
+}
+
+// Returns true if a table of nbuckets is past the upgrade threshold or the
+// memory budget, so the filter upgrades rather than growing to it.
+static bool rhbloom_toolarge(struct rhbloom *rhbloom, size_t nbuckets) {
+    size_t size = rhbloom_tablesize(rhbloom, nbuckets);
+    return (double)size >= rhbloom->upgrade * (double)rhbloom_bitsize(rhbloom)
+        || (rhbloom->budget && size > rhbloom->budget);
+}
+
+static bool rhbloom_grow_step(struct rhbloom *rhbloom) {
+    size_t nbuckets_new = rhbloom->nbuckets == 0 ? 16 : rhbloom->nbuckets * 2;
+    bool upgrade = rhbloom_toolarge(rhbloom, nbuckets_new);
+    if (rhbloom->incremental) {
+        if (rhbloom->buckets_old) {
+            // Still migrating, finish before growing again.
+            rhbloom_migrate_all(rhbloom);
+            return true;
+        }
+        return rhbloom_grow_incremental(rhbloom, nbuckets_new, upgrade);
+    }
+    if (upgrade) {
+        return rhbloom_upgrade(rhbloom);
+    }
+    return rhbloom_rehash(rhbloom, nbuckets_new);
+}
+
+static bool rhbloom_grow(struct rhbloom *rhbloom) {
+#ifdef RHBLOOM_STATS
+    uint64_t start = rhbloom_clock(CLOCK_MONOTONIC);
+    bool ok = rhbloom_grow_step(rhbloom);
+    uint64_t elapsed = rhbloom_clock(CLOCK_MONOTONIC) - start;
+    RHBLOOM_STORE_RELAXED(&rhbloom->grows, rhbloom->grows + 1);
+    RHBLOOM_STORE_RELAXED(&rhbloom->grow_ns, rhbloom->grow_ns + elapsed);
+    return ok;
+#else
+    return rhbloom_grow_step(rhbloom);
+#endif
+}
+
+// Largest number of keys that the hashmap holds before upgrading.
+static size_t rhbloom_hashmap_cap(struct rhbloom *rhbloom) {
+    size_t nbuckets = 16;
+    if (rhbloom_toolarge(rhbloom, nbuckets)) {
+        return 0;
+    }
+    while (!rhbloom_toolarge(rhbloom, nbuckets*2)) {
+        nbuckets *= 2;
+    }
+    return rhbloom_maxcount(rhbloom, nbuckets);
+}
+
+// Size the filter for n keys in one step.
+static bool rhbloom_resize_for(struct rhbloom *rhbloom, size_t n) {
+    rhbloom_migrate_all(rhbloom);
+    if (rhbloom->bits || n == 0) {
+        return true;
+    }
+    if (n > rhbloom_hashmap_cap(rhbloom)) {
+        return rhbloom_upgrade(rhbloom);
+    }
+    size_t nbuckets = 16;
+    while (rhbloom_maxcount(rhbloom, nbuckets) < n) {
+        nbuckets *= 2;
+    }
+    if (nbuckets <= rhbloom->nbuckets) {
+        return true;
+    }
+    return rhbloom_rehash(rhbloom, nbuckets);
+}
+
+// Move the bits of the newest layer into an older layer, and start a new
+// layer with twice the keys at half the false positive rate.
+static bool rhbloom_push_layer(struct rhbloom *rhbloom) {
+    rhbloom_migrate_all(rhbloom);
+    bool blocked = rhbloom->pmask != rhbloom->m-1;
+    size_t k, m;
+    rhbloom_params(rhbloom->cap * 2, rhbloom->p / 2, blocked, &k, &m);
+    struct rhbloom_options opts = { 0 };
+    opts.malloc = rhbloom->malloc;
+    opts.free = rhbloom->free;
+    opts.allocator = rhbloom->allocator.malloc ? &rhbloom->allocator : 0;
+    opts.pages = rhbloom->pages;
+    opts.numa = rhbloom->numa;
+    opts.numa_node = rhbloom->numa_node;
+    opts.branchless = rhbloom->branchless;
+    struct rhbloom *layer = rhbloom_alloc(k, m, blocked, &opts);
+    if (!layer) {
+        return false;
+    }
+    uint64_t *bits = rhbloom_bits_alloc(layer, &layer->bitsmem);
+    if (!bits) {
+        rhbloom_free(layer);
+        return false;
+    }
+    // Swap, so the new bits belong to the filter and the old to the layer.
+    layer->bits = rhbloom->bits;
+    layer->k = rhbloom->k;
+    layer->m = rhbloom->m;
+    layer->pmask = rhbloom->pmask;
+    void *bitsmem = layer->bitsmem;
+    size_t bitsmapped = layer->bitsmapped;
+    layer->bitsmem = rhbloom->bitsmem;
+    layer->bitsmapped = rhbloom->bitsmapped;
+    layer->prev = rhbloom->prev;
+    layer->nbits = rhbloom->nbits;
+    rhbloom->bits = bits;
+    rhbloom->nbits = 0;
+    rhbloom->bitsmem = bitsmem;
+    rhbloom->bitsmapped = bitsmapped;
+    rhbloom->k = k;
+    rhbloom->m = m;
+    rhbloom->pmask = blocked ? RHBLOOM_BLOCKBITS-1 : m-1;
+    rhbloom->cap *= 2;
+    rhbloom->p /= 2;
+    rhbloom->nkeys = 0;
+    rhbloom->prev = layer;
+    return true;
+}
+
+// Returns true if the key is in one of the older layers.
+static bool rhbloom_testlayers(struct rhbloom *rhbloom, uint64_t key) {
+    for (struct rhbloom *layer = rhbloom->prev; layer; layer = layer->prev) {
+        if (rhbloom_testadd(layer, key, false)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Add the key to the newest layer of a scalable filter.
+static bool rhbloom_addlayer(struct rhbloom *rhbloom, uint64_t key) {
+    if (rhbloom_testlayers(rhbloom, key)) {
+        return true;
+    }
+    if (rhbloom->nkeys >= rhbloom->cap && !rhbloom_push_layer(rhbloom)) {
+        return false;
+    }
+    rhbloom->nkeys += rhbloom_testadd(rhbloom, key, true);
+    return true;
+}
+
+#ifdef RHBLOOM_ATOMICS
+static bool rhbloom_addhash_concurrent(struct rhbloom *rhbloom, uint64_t key);
+static enum rhbloom_result rhbloom_testhash_concurrent(struct rhbloom *rhbloom,
+    uint64_t key);
+#endif
+
+static bool rhbloom_probe(struct rhbloom *rhbloom, uint64_t *buckets, 
+    size_t nbuckets, uint64_t key);
+
+static bool rhbloom_addhash(struct rhbloom *rhbloom, uint64_t key) {
+    if (rhbloom->view) {
+        return false;
+    }
+#ifdef RHBLOOM_ATOMICS
+    if (rhbloom->sync) {
+        return rhbloom_addhash_concurrent(rhbloom, key);
+    }
+#endif
+    if (rhbloom->buckets_old) {
+        rhbloom_migrate(rhbloom, RHBLOOM_MIGRATE);
+    }
+    while (1) {
+        if (rhbloom->bits && rhbloom->scalable) {
+            return rhbloom_addlayer(rhbloom, key);
+        }
+        if (rhbloom->bits) {
+            rhbloom_testadd(rhbloom, key, true);
+            return true;
+        }
+        if (rhbloom->buckets_old && rhbloom_probe(rhbloom, 
+            rhbloom->buckets_old, rhbloom->nbuckets_old, key))
+        {
+            // Already added, and moves over with the old buckets.
+            return true;
+        }
+        if (rhbloom->count >= rhbloom_maxcount(rhbloom, rhbloom->nbuckets) || 
+            !rhbloom_addkey(rhbloom, key))
+        {
+            if (!rhbloom_grow(rhbloom)) {
+                return false;
+            }
+            continue;
+        }
+        return true;
+    }
+}
+
+// Returns true if the key exists in the buckets.
+static bool rhbloom_probe(struct rhbloom *rhbloom, uint64_t *buckets, 
+    size_t nbuckets, uint64_t key)
+{
+    struct rhbloom_table t = rhbloom_table(rhbloom, buckets, nbuckets);
+    key = RHBLOOM_KEY(key);
+    int dib = 1;
+    size_t i = rhbloom_scan(&t, key, key & (nbuckets-1), &dib);
+    RHBLOOM_STAT_PROBE(rhbloom, dib);
+    return RHBLOOM_KEY(rhbloom_get(&t, i)) == key;
+}
+
+// Result for a key that was found in the buckets. Compressed buckets only
+// keep part of the key, so that's not exact.
+static enum rhbloom_result rhbloom_hit(struct rhbloom *rhbloom) {
+    return rhbloom->fpbits ? RHBLOOM_PROBABLE : RHBLOOM_PRESENT;
+}
+
+static enum rhbloom_result rhbloom_testhash_ex(struct rhbloom *rhbloom, 
+    uint64_t key)
+{
+#ifdef RHBLOOM_ATOMICS
+    if (rhbloom->sync) {
+        return rhbloom_testhash_concurrent(rhbloom, key);
+    }
+#endif
+    if (rhbloom->buckets_old) {
+        rhbloom_migrate(rhbloom, RHBLOOM_MIGRATE);
+        if (rhbloom->buckets_old && 
+            rhbloom_probe(rhbloom, rhbloom->buckets_old, rhbloom->nbuckets_old, 
+                key))
+        {
+            return rhbloom_hit(rhbloom);
+        }
+    }
+    if (rhbloom->bits) {
+        if (rhbloom_testadd(rhbloom, key, false) || 
+            (rhbloom->prev && rhbloom_testlayers(rhbloom, key)))
+        {
+            return RHBLOOM_PROBABLE;
+        }
+        return RHBLOOM_ABSENT;
+    }
+    if (rhbloom->buckets && 
+        rhbloom_probe(rhbloom, rhbloom->buckets, rhbloom->nbuckets, key))
+    {
+        return rhbloom_hit(rhbloom);
+    }
+    return RHBLOOM_ABSENT;
+}
+
+static bool rhbloom_testhash(struct rhbloom *rhbloom, uint64_t key) {
+    return rhbloom_testhash_ex(rhbloom, key) != RHBLOOM_ABSENT;
+}
+
+#ifdef RHBLOOM_ATOMICS
+static bool rhbloom_addhash_concurrent(struct rhbloom *rhbloom, uint64_t key) {
+    if (RHBLOOM_LOAD_ACQUIRE(&rhbloom->bits)) {
+        rhbloom_testadd(rhbloom, key, true);
+        return true;
+    }
+    pthread_mutex_lock(&rhbloom->sync->lock);
+    while (!rhbloom->bits) {
+        bool added = false;
+        if (rhbloom->count < rhbloom_maxcount(rhbloom, rhbloom->nbuckets)) {
+            rhbloom_write_begin(rhbloom);
+            added = rhbloom_addkey(rhbloom, key);
+            rhbloom_write_end(rhbloom);
+        }
+        if (!added) {
+            if (!rhbloom_grow(rhbloom)) {
+                pthread_mutex_unlock(&rhbloom->sync->lock);
+                return false;
+            }
+            continue;
+        }
+        pthread_mutex_unlock(&rhbloom->sync->lock);
+        return true;
+    }
+    // Upgraded while waiting on the lock.
+    pthread_mutex_unlock(&rhbloom->sync->lock);
+    rhbloom_testadd(rhbloom, key, true);
+    return true;
+}
+
+static enum rhbloom_result rhbloom_testhash_concurrent(struct rhbloom *rhbloom,
+    uint64_t key)
+{
+    struct rhbloom_sync *sync = rhbloom->sync;
+    if (RHBLOOM_LOAD_ACQUIRE(&rhbloom->bits)) {
+        return rhbloom_testadd(rhbloom, key, false) ? RHBLOOM_PROBABLE : 
+            RHBLOOM_ABSENT;
+    }
+    // Enter the current epoch. The mixed key spreads readers over the
+    // stripes.
+    size_t *readers;
+    size_t stripe = ((key >> 56) ^ (key >> 4)) & (RHBLOOM_STRIPES-1);
+    while (1) {
+        size_t epoch = RHBLOOM_LOAD_ACQUIRE(&sync->epoch);
+        readers = &sync->stripes[stripe].readers[epoch&1];
+        RHBLOOM_ADD_SEQCST(readers, 1);
+        if (RHBLOOM_LOAD_SEQCST(&sync->epoch) == epoch) {
+            break;
+        }
+        RHBLOOM_SUB_RELEASE(readers, 1);
+    }
+    enum rhbloom_result res;
+    while (1) {
+        if (RHBLOOM_LOAD_ACQUIRE(&rhbloom->bits)) {
+            res = rhbloom_testadd(rhbloom, key, false) ? RHBLOOM_PROBABLE : 
+                RHBLOOM_ABSENT;
+            break;
+        }
+        size_t seq = RHBLOOM_LOAD_ACQUIRE(&sync->seq);
+        if (seq & 1) {
+            continue;
+        }
+        size_t nbuckets = RHBLOOM_LOAD_ACQUIRE(&rhbloom->nbuckets);
+        uint64_t *buckets = RHBLOOM_LOAD_ACQUIRE(&rhbloom->buckets);
+        bool yes = buckets && rhbloom_probe(rhbloom, buckets, nbuckets, key);
+        res = yes ? rhbloom_hit(rhbloom) : RHBLOOM_ABSENT;
+        RHBLOOM_FENCE_ACQUIRE();
+        if (RHBLOOM_LOAD_RELAXED(&sync->seq) == seq) {
+            break;
+        }
+    }
+    RHBLOOM_SUB_RELEASE(readers, 1);
+    return res;
+}
+#endif
+
+// Prefetch the memory that a following add or test of the mixed key will
+// touch. That's the home bucket for the hashmap, or every bloom probe.
+static void rhbloom_prefetch(struct rhbloom *rhbloom, uint64_t key) {
+    key = RHBLOOM_KEY(key);
+    if (RHBLOOM_LOAD_ACQUIRE(&rhbloom->bits)) {
+        size_t j = key & (rhbloom->m-1);
+        size_t base = j & ~rhbloom->pmask;
+        RHBLOOM_PREFETCH(&rhbloom->bits[rhbloom_word(rhbloom, j)]);
+        if (rhbloom->pmask == RHBLOOM_BLOCKBITS-1 && !rhbloom->counting) {
+            // The block is already on its way.
+            return;
+        }
+        for (size_t i = 1; i < rhbloom->k; i++) {
+            key = rhbloom_next(key);
+            j = base | (key & rhbloom->pmask);
+            RHBLOOM_PREFETCH(&rhbloom->bits[rhbloom_word(rhbloom, j)]);
+        }
+    } else if (rhbloom->buckets && !rhbloom->sync) {
+        size_t i = key & (rhbloom->nbuckets-1);
+        if (rhbloom->fpbits) {
+            i = i * rhbloom_slotbits(rhbloom, rhbloom->nbuckets) / 64;
+        }
+        RHBLOOM_PREFETCH(&rhbloom->buckets[i]);
+    }
+}
+
+/// Adds a key to the filter.
+/// For a concurrent filter this is safe to call from many threads at once,
+/// alongside rhbloom_test and the batch functions.
+/// @return true if key was added or false if out of memory or a view
+bool rhbloom_add(struct rhbloom *rhbloom, uint64_t key) {
+    return rhbloom_addhash(rhbloom, rhbloom_hash(rhbloom, key));
+}
+
+/// Reserve room for a total of n keys.
+/// The hashmap is grown to fit n keys, or upgraded to a bloom filter right
+/// away when n keys would upgrade it anyway. Adding up to n keys afterwards
+/// will not allocate or rehash.
+/// @return false if out of memory or a view
+bool rhbloom_reserve(struct rhbloom *rhbloom, size_t n) {
+    if (rhbloom->view) {
+        return false;
+    }
+#ifdef RHBLOOM_ATOMICS
+    if (rhbloom->sync) {
+        pthread_mutex_lock(&rhbloom->sync->lock);
+        bool ok = rhbloom_resize_for(rhbloom, n);
+        pthread_mutex_unlock(&rhbloom->sync->lock);
+        return ok;
+    }
+#endif
+    return rhbloom_resize_for(rhbloom, n);
+}
+
+/// Check if key probably exists in filter.
+/// @return true if probably exists or false if not exists
+bool rhbloom_test(struct rhbloom *rhbloom, uint64_t key) {
+    return rhbloom_testhash(rhbloom, rhbloom_hash(rhbloom, key));
+}
+
+/// Check if key exists in filter, and how sure that answer is.
+/// While the filter is a hashmap the answer is exact, RHBLOOM_ABSENT or
+/// RHBLOOM_PRESENT. Present keys match all 56 bits of the mixed key, so two
+/// different keys are mistaken only on a 56-bit collision. Compressed
+/// filters keep fewer bits and answer RHBLOOM_PROBABLE instead, as does any
+/// positive once upgraded. Absent is always definite.
+enum rhbloom_result rhbloom_test_ex(struct rhbloom *rhbloom, uint64_t key) {
+    return rhbloom_testhash_ex(rhbloom, rhbloom_hash(rhbloom, key));
+}
+
+/// Start a lookup of a key, to be finished with rhbloom_lookup_finish.
+/// The key is mixed and the memory that the test reads is prefetched, so
+/// that other work can run while it loads, such as other lookups or other
+/// coroutines. The filter may change in between, and the lookup answers for
+/// the filter as it is when finished.
+/// @return the pending lookup
+struct rhbloom_lookup rhbloom_lookup_begin(struct rhbloom *rhbloom, 
+    uint64_t key)
+{
+    struct rhbloom_lookup lookup = { rhbloom_hash(rhbloom, key) };
+    rhbloom_prefetch(rhbloom, lookup.hash);
+    return lookup;
+}
+
+/// Start a lookup of a byte string key, like rhbloom_lookup_begin.
+struct rhbloom_lookup rhbloom_lookup_begin_bytes(struct rhbloom *rhbloom, 
+    const void *data, size_t len)
+{
+    struct rhbloom_lookup lookup = { rhbloom_hash_bytes(rhbloom, data, len) };
+    rhbloom_prefetch(rhbloom, lookup.hash);
+    return lookup;
+}
+
+/// Finish a lookup that was started with rhbloom_lookup_begin.
+/// @return true if the key probably exists, like rhbloom_test
+bool rhbloom_lookup_finish(struct rhbloom *rhbloom, 
+    struct rhbloom_lookup lookup)
+{
+    return rhbloom_testhash(rhbloom, lookup.hash);
+}
+
+static bool rhbloom_delhash(struct rhbloom *rhbloom, uint64_t key) {
+    rhbloom_migrate_all(rhbloom);
+    if (rhbloom->bits) {
+        return rhbloom->counting && 
+            rhbloom_testadd_counters(rhbloom, rhbloom->bits, key, -1);
+    }
+    if (!rhbloom->buckets) {
+        return false;
+    }
+    struct rhbloom_table t = rhbloom_table(rhbloom, rhbloom->buckets, 
+        rhbloom->nbuckets);
+    rhbloom_write_begin(rhbloom);
+    bool removed = rhbloom_remove(&t, key);
+    rhbloom->count -= removed;
+    rhbloom_write_end(rhbloom);
+    if (removed) {
+        // The log only holds adds.
+        rhbloom_untrack(rhbloom);
+    }
+    return removed;
+}
+
+/// Delete a key from the filter.
+/// This is exact while the filter is a hashmap. Once upgraded only counting
+/// filters can delete, by decrementing the counters of a key that tests
+/// positive. Only delete keys that were added, since deleting a false
+/// positive takes counts away from other keys. Counters that reached 15 stay
+/// put, so a crowded key may keep testing positive.
+/// For a concurrent filter this is safe to call alongside the other
+/// functions while in the hashmap phase.
+/// @return true if the key was deleted, or false if it was not found, the
+/// filter is a view, or an upgraded filter without counting
+bool rhbloom_delete(struct rhbloom *rhbloom, uint64_t key) {
+    if (rhbloom->view) {
+        return false;
+    }
+    key = rhbloom_hash(rhbloom, key);
+#ifdef RHBLOOM_ATOMICS
+    if (rhbloom->sync) {
+        pthread_mutex_lock(&rhbloom->sync->lock);
+        bool ok = !rhbloom->bits && rhbloom_delhash(rhbloom, key);
+        pthread_mutex_unlock(&rhbloom->sync->lock);
+        return ok;
+    }
+#endif
+    return rhbloom_delhash(rhbloom, key);
+}
+
+// Add a batch of up to RHBLOOM_BATCH hashed keys, prefetching them all first.
+static bool rhbloom_addhash_batch(struct rhbloom *rhbloom, 
+    const uint64_t *hashes, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        rhbloom_prefetch(rhbloom, hashes[i]);
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (!rhbloom_addhash(rhbloom, hashes[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Test a batch of up to RHBLOOM_BATCH hashed keys, prefetching them all first.
+static void rhbloom_testhash_batch(struct rhbloom *rhbloom, 
+    const uint64_t *hashes, size_t n, bool *out)
+{
+    for (size_t i = 0; i < n; i++) {
+        rhbloom_prefetch(rhbloom, hashes[i]);
+    }
+    if (RHBLOOM_LOAD_ACQUIRE(&rhbloom->bits) && !rhbloom->buckets_old) {
+        rhbloom->testbits(rhbloom, hashes, n, out);
+        if (rhbloom->testbits != rhbloom_testbits) {
+            // The vector kernels read all k bits of every key.
+            RHBLOOM_STAT_BLOOM(rhbloom, n, n * rhbloom->k);
+        }
+        for (size_t i = 0; rhbloom->prev && i < n; i++) {
+            out[i] = out[i] || rhbloom_testlayers(rhbloom, hashes[i]);
+        }
+        return;
+    }
+    for (size_t i = 0; i < n; i++) {
+        out[i] = rhbloom_testhash(rhbloom, hashes[i]);
+    }
+}
+
+/// Adds many keys to the filter.
+/// Keys are mixed and prefetched a batch at a time, allowing the memory
+/// loads of neighboring keys to overlap.
+/// @return true if all keys were added or false if out of memory or a view
+bool rhbloom_add_batch(struct rhbloom *rhbloom, const uint64_t *keys, 
+    size_t n)
+{
+    uint64_t hashes[RHBLOOM_BATCH];
+    for (size_t i = 0; i < n; i += RHBLOOM_BATCH) {
+        size_t nb = n - i < RHBLOOM_BATCH ? n - i : RHBLOOM_BATCH;
+        for (size_t j = 0; j < nb; j++) {
+            hashes[j] = rhbloom_hash(rhbloom, keys[i+j]);
+        }
+        if (!rhbloom_addhash_batch(rhbloom, hashes, nb)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/// Check if many keys probably exist in filter.
+/// Keys are mixed and prefetched a batch at a time, allowing the memory
+/// loads of neighboring keys to overlap.
+/// @param out receives the rhbloom_test result for each key
+void rhbloom_test_batch(struct rhbloom *rhbloom, const uint64_t *keys, 
+    size_t n, bool *out)
+{
+    uint64_t hashes[RHBLOOM_BATCH];
+    for (size_t i = 0; i < n; i += RHBLOOM_BATCH) {
+        size_t nb = n - i < RHBLOOM_BATCH ? n - i : RHBLOOM_BATCH;
+        for (size_t j = 0; j < nb; j++) {
+            hashes[j] = rhbloom_hash(rhbloom, keys[i+j]);
+        }
+        rhbloom_testhash_batch(rhbloom, hashes, nb, out+i);
+    }
+}
+
+/// Add a byte string key, such as a string, to the filter.
+/// The bytes are hashed with a built-in 64-bit hash, which takes the place
+/// of the integer key mix. The hash does not depend on the platform, so
+/// serialized filters may be shared. Byte keys and integer keys should not
+/// be mixed in one filter.
+/// @return true if added or false if out of memory or a view
+bool rhbloom_add_bytes(struct rhbloom *rhbloom, const void *data, size_t len) {
+    return rhbloom_addhash(rhbloom, rhbloom_hash_bytes(rhbloom, data, len));
+}
+
+/// Check if a byte string key probably exists in filter.
+bool rhbloom_test_bytes(struct rhbloom *rhbloom, const void *data, 
+    size_t len)
+{
+    return rhbloom_testhash(rhbloom, rhbloom_hash_bytes(rhbloom, data, len));
+}
+
+/// Adds many byte string keys to the filter, like rhbloom_add_batch.
+/// @param keys pointers to the key bytes
+/// @param lens lengths of the keys
+/// @return true if all keys were added or false if out of memory or a view
+bool rhbloom_add_bytes_batch(struct rhbloom *rhbloom, 
+    const void *const *keys, const size_t *lens, size_t n)
+{
+    uint64_t hashes[RHBLOOM_BATCH];
+    for (size_t i = 0; i < n; i += RHBLOOM_BATCH) {
+        size_t nb = n - i < RHBLOOM_BATCH ? n - i : RHBLOOM_BATCH;
+        for (size_t j = 0; j < nb; j++) {
+            hashes[j] = rhbloom_hash_bytes(rhbloom, keys[i+j], lens[i+j]);
+        }
+        if (!rhbloom_addhash_batch(rhbloom, hashes, nb)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/// Check if many byte string keys probably exist in filter, like
+/// rhbloom_test_batch.
+/// @param keys pointers to the key bytes
+/// @param lens lengths of the keys
+/// @param out receives the rhbloom_test_bytes result for each key
+void rhbloom_test_bytes_batch(struct rhbloom *rhbloom, 
+    const void *const *keys, const size_t *lens, size_t n, bool *out)
+{
+    uint64_t hashes[RHBLOOM_BATCH];
+    for (size_t i = 0; i < n; i += RHBLOOM_BATCH) {
+        size_t nb = n - i < RHBLOOM_BATCH ? n - i : RHBLOOM_BATCH;
+        for (size_t j = 0; j < nb; j++) {
+            hashes[j] = rhbloom_hash_bytes(rhbloom, keys[i+j], lens[i+j]);
+        }
+        rhbloom_testhash_batch(rhbloom, hashes, nb, out+i);
+    }
+}
+
+/// Get the memory size in bytes of this filter.
+size_t rhbloom_memsize(struct rhbloom *rhbloom) {
+    size_t size = sizeof(struct rhbloom);
+    if (rhbloom->bits) {
+        size += rhbloom_bitsize(rhbloom);
+    } else if (rhbloom->buckets && rhbloom->buckets != rhbloom->small) {
+        size += rhbloom_tablesize(rhbloom, rhbloom->nbuckets);
+    }
+    size += rhbloom->nbuckets_old << 3;
+    size += rhbloom->logcap * 8;
+    if (rhbloom->dirty) {
+        size += (rhbloom_nblocks(rhbloom) + 63) / 64 * 8;
+    }
+    size += rhbloom->prev ? rhbloom_memsize(rhbloom->prev) : 0;
+#ifdef RHBLOOM_ATOMICS
+    size += rhbloom->sync ? sizeof(struct rhbloom_sync) : 0;
+#endif
+    return size;
+}
+
+/// Returns true if been upgraded to a bloom filter
+bool rhbloom_upgraded(struct rhbloom *rhbloom) {
+    return !!RHBLOOM_LOAD_ACQUIRE(&rhbloom->bits);
+}
+
+// Estimated number of distinct keys in a single layer.
+static double rhbloom_layer_estimate(struct rhbloom *rhbloom) {
+    if (!RHBLOOM_LOAD_ACQUIRE(&rhbloom->bits)) {
+        return (double)(RHBLOOM_LOAD_RELAXED(&rhbloom->count) + rhbloom->nold);
+    }
+    double m = (double)rhbloom->m;
+    double x = (double)rhbloom_nbits(rhbloom);
+    if (x >= m) {
+        return INFINITY;
+    }
+    return -(m / (double)rhbloom->k) * log1p(-x / m);
+}
+
+/// Returns the estimated number of distinct keys in the filter.
+/// While a hashmap the count is exact, less the keys that were lost to
+/// colliding fingerprints of a compressed filter. Once upgraded it's
+/// estimated from the number of set bits, or nonzero counters, which are
+/// tracked as keys are added. That's O(m) for a view, which doesn't track
+/// them. The layers of a scalable filter are summed.
+/// Duplicate adds to a counting filter count once.
+/// @return the estimate, or SIZE_MAX if every bit is set
+size_t rhbloom_count_estimate(struct rhbloom *rhbloom) {
+    double n = 0;
+    for (struct rhbloom *layer = rhbloom; layer; layer = layer->prev) {
+        n += rhbloom_layer_estimate(layer);
+    }
+    return n >= (double)SIZE_MAX ? SIZE_MAX : (size_t)(n + 0.5);
+}
+
+// Estimated false positive rate of a single layer.
+static double rhbloom_layer_fpr(struct rhbloom *rhbloom) {
+    if (!RHBLOOM_LOAD_ACQUIRE(&rhbloom->bits)) {
+        // Only a fingerprint collision gives a false positive.
+        int fpbits = rhbloom->fpbits ? rhbloom->fpbits : 56;
+        double p = rhbloom_layer_estimate(rhbloom) / ldexp(1, fpbits);
+        return p < 1 ? p : 1;
+    }
+    double x = (double)rhbloom_nbits(rhbloom) / (double)rhbloom->m;
+    return pow(x < 1 ? x : 1, (double)rhbloom->k);
+}
+
+/// Returns the estimated false positive rate of the filter as it is now.
+/// That's the fraction of set bits, or nonzero counters, to the power of k
+/// once upgraded. While a hashmap it's the chance of a key matching one of
+/// the stored fingerprints, which is tiny unless the filter is compressed.
+/// A scalable filter reports a false positive when any layer does.
+/// The rate of a blocked filter is somewhat higher than estimated, since
+/// some blocks fill up more than others.
+double rhbloom_fpr_estimate(struct rhbloom *rhbloom) {
+    double q = 1;
+    for (struct rhbloom *layer = rhbloom; layer; layer = layer->prev) {
+        q *= 1 - rhbloom_layer_fpr(layer);
+    }
+    return 1 - q;
+}
+
+/// Take a snapshot of the instrumentation counters.
+/// The counters are only kept when the library is built with RHBLOOM_STATS
+/// defined, otherwise they compile to nothing and the snapshot is all zeros.
+/// On a concurrent filter the counters are read while other threads keep
+/// counting, so they may be slightly out of step with each other.
+/// @return false if built without RHBLOOM_STATS
+bool rhbloom_stats(struct rhbloom *rhbloom, struct rhbloom_stats *stats) {
+    memset(stats, 0, sizeof(struct rhbloom_stats));
+#ifdef RHBLOOM_STATS
+    for (struct rhbloom *layer = rhbloom; layer; layer = layer->prev) {
+        for (size_t i = 0; i < rhbloom_nslots(layer); i++) {
+            struct rhbloom_counters *slot = &layer->counters[i];
+            uint64_t max_probe = RHBLOOM_LOAD_RELAXED(&slot->max_probe);
+            stats->probes += RHBLOOM_LOAD_RELAXED(&slot->probes);
+            stats->probe_length += RHBLOOM_LOAD_RELAXED(&slot->probe_length);
+            stats->max_probe = max_probe > stats->max_probe ? max_probe : 
+                stats->max_probe;
+            stats->bloom_tests += RHBLOOM_LOAD_RELAXED(&slot->bloom_tests);
+            stats->bloom_bits += RHBLOOM_LOAD_RELAXED(&slot->bloom_bits);
+        }
+    }
+    stats->grows = RHBLOOM_LOAD_RELAXED(&rhbloom->grows);
+    stats->grow_ns = RHBLOOM_LOAD_RELAXED(&rhbloom->grow_ns);
+    stats->upgrade_ns = RHBLOOM_LOAD_RELAXED(&rhbloom->upgrade_ns);
+    if (stats->probes) {
+        stats->avg_probe = (double)stats->probe_length / stats->probes;
+    }
+    if (stats->bloom_tests) {
+        stats->avg_bits = (double)stats->bloom_bits / stats->bloom_tests;
+    }
+    return true;
+#else
+    (void)rhbloom;
+    return false;
+#endif
+}
+
+/// Clear all entries in the filter without freeing resources.
+/// Not safe to call during other operations on a concurrent filter.
+/// The older layers of a scalable filter are freed.
+/// Does nothing for a view.
+void rhbloom_clear(struct rhbloom *rhbloom) {
+    if (rhbloom->view) {
+        return;
+    }
+    if (rhbloom->buckets_old) {
+        rhbloom_buckets_free(rhbloom, rhbloom->buckets_old);
+        rhbloom->buckets_old = 0;
+        rhbloom->nbuckets_old = 0;
+        rhbloom->migrated = 0;
+        rhbloom->nold = 0;
+    }
+    if (rhbloom->prev) {
+        // Older layers go, the newest and largest one stays.
+        rhbloom_free(rhbloom->prev);
+        rhbloom->prev = 0;
+    }
+    rhbloom->nkeys = 0;
+    rhbloom_untrack(rhbloom);
+    if (rhbloom->bits) {
+        rhbloom_bits_zero(rhbloom);
+        rhbloom_recount(rhbloom);
+    } else if (rhbloom->buckets) {
+        memset(rhbloom->buckets, 0, 
+            rhbloom_tablesize(rhbloom, rhbloom->nbuckets));
         rhbloom->count = 0;
-   }
+    }
+}
+
+/// Remove all entries and go back to the state of a new filter, a hashmap
+/// with no table. The bloom bits and tables are freed, so a large filter
+/// shrinks back down until it's filled again. A scalable filter returns to
+/// its first layer.
+/// Not safe to call during other operations on a concurrent filter.
+/// Does nothing for a view.
+void rhbloom_reset(struct rhbloom *rhbloom) {
+    if (rhbloom->view) {
+        return;
+    }
+    if (rhbloom->prev) {
+        // The parameters of the first layer, which is the oldest one.
+        struct rhbloom *first = rhbloom->prev;
+        rhbloom->cap /= 2;
+        rhbloom->p *= 2;
+        while (first->prev) {
+            first = first->prev;
+            rhbloom->cap /= 2;
+            rhbloom->p *= 2;
+        }
+        rhbloom->k = first->k;
+        rhbloom->m = first->m;
+        rhbloom->pmask = first->pmask;
+        rhbloom_free(rhbloom->prev);
+        rhbloom->prev = 0;
+    }
+    rhbloom_buckets_free(rhbloom, rhbloom->buckets_old);
+    rhbloom->buckets_old = 0;
+    rhbloom->nbuckets_old = 0;
+    rhbloom->migrated = 0;
+    rhbloom->nold = 0;
+    rhbloom_buckets_free(rhbloom, rhbloom->buckets);
+    rhbloom->buckets = 0;
+    rhbloom->nbuckets = 0;
+    rhbloom->count = 0;
+    rhbloom_untrack(rhbloom);
+    rhbloom_bits_free(rhbloom);
+    rhbloom->bits = 0;
+    rhbloom->nkeys = 0;
+    rhbloom_recount(rhbloom);
+#ifdef RHBLOOM_STATS
+    rhbloom->upgrade_ns = 0;
+#endif
+}
+
+// Serialized format, all integers are little-endian.
+//
+//   0   magic    "RHBLOOM\0"
+//   8   version  u32
+//   12  flags    u32, RHBLOOM_FUPGRADED | RHBLOOM_FBLOCKED |
+//                RHBLOOM_FCOUNTING | RHBLOOM_FCOMPRESS32 |
+//                RHBLOOM_FCOMPRESS16 | RHBLOOM_FDELTA
+//   16  k        u64, number of bits per key
+//   24  m        u64, number of bits total
+//   32  count    u64, number of keys in hashtable
+//   40  nbuckets u64, number of buckets
+//   48  size     u64, payload size in bytes
+//   56  checksum u64, of the header bytes 0-55 followed by the payload
+//   64  payload  bloom words when upgraded, otherwise the hashtable buckets,
+//                as u64s. Counting filters have m 4-bit counters in place of
+//                the bits, 16 per word. The larger tables of compressed
+//                filters pack 16 or 32-bit slots into the u64s, from the low
+//                bits up.
+//
+// A delta, written by rhbloom_delta, has RHBLOOM_FDELTA set. Its payload
+// starts with two u64s, the snapshot id that it applies to, or 0 for a full
+// delta, and the new snapshot id. A full delta follows with the payload of
+// rhbloom_serialize. Otherwise an upgraded filter follows with its changed
+// blocks, each one a u64 block index and the RHBLOOM_DELTABLOCK bytes of the
+// block, or less for a short last block, and a hashmap follows with the
+// hashed keys that it added, as u64s. The count and nbuckets fields are
+// those of the filter that wrote it.
+//
+// The header is 64 bytes so the payload keeps the alignment of the buffer.
+#define RHBLOOM_MAGIC "RHBLOOM"
+#define RHBLOOM_VERSION 1
+#define RHBLOOM_HDRSIZE 64
+#define RHBLOOM_FUPGRADED 1
+#define RHBLOOM_FBLOCKED 2
+#define RHBLOOM_FCOUNTING 4
+#define RHBLOOM_FCOMPRESS32 8
+#define RHBLOOM_FCOMPRESS16 16
+#define RHBLOOM_FDELTA 32
+
+// Slot width of the largest table of a compressed filter, 0 when not
+// compressed, or -1 when the flags are invalid.
+static int rhbloom_header_fpwidth(uint32_t flags) {
+    switch (flags & (RHBLOOM_FCOMPRESS32|RHBLOOM_FCOMPRESS16)) {
+    case 0: return 0;
+    case RHBLOOM_FCOMPRESS32: return 32;
+    case RHBLOOM_FCOMPRESS16: return 16;
+    default: return -1;
+    }
+}
+
+static uint64_t rhbloom_swap64(uint64_t x) {
+#ifdef RHBLOOM_BIG_ENDIAN
+    x = ((x & UINT64_C(0x00FF00FF00FF00FF)) << 8) | 
+        ((x >> 8) & UINT64_C(0x00FF00FF00FF00FF));
+    x = ((x & UINT64_C(0x0000FFFF0000FFFF)) << 16) | 
+        ((x >> 16) & UINT64_C(0x0000FFFF0000FFFF));
+    x = (x << 32) | (x >> 32);
+#endif
+    return x;
+}
+
+static void rhbloom_write64(uint8_t *dst, uint64_t x) {
+    for (int i = 0; i < 8; i++) {
+        dst[i] = (uint8_t)(x >> (i*8));
+    }
+}
+
+static uint64_t rhbloom_read64(const uint8_t *src) {
+    uint64_t x = 0;
+    for (int i = 0; i < 8; i++) {
+        x |= (uint64_t)src[i] << (i*8);
+    }
+    return x;
+}
+
+// Copy u64s between native and little-endian order
+static void rhbloom_copy64(void *dst, const void *src, size_t n) {
+#ifdef RHBLOOM_BIG_ENDIAN
+    for (size_t i = 0; i < n; i++) {
+        uint64_t x;
+        memcpy(&x, (const uint8_t*)src+i*8, 8);
+        x = rhbloom_swap64(x);
+        memcpy((uint8_t*)dst+i*8, &x, 8);
+    }
+#else
+    if (n) {
+        memcpy(dst, src, n*8);
+    }
+#endif
+}
+
+// Checksum of little-endian u64s.
+static uint64_t rhbloom_checksum(uint64_t h, const void *data, size_t n) {
+    const uint8_t *p = data;
+    for (size_t i = 0; i < n; i++) {
+        uint64_t x;
+        memcpy(&x, p+i*8, 8);
+        h = (h ^ rhbloom_swap64(x)) * UINT64_C(0x9e3779b97f4a7c15);
+        h ^= h >> 32;
+    }
+    return h;
+}
+
+// Header flags of the filter.
+static uint32_t rhbloom_flags(struct rhbloom *rhbloom) {
+    return (rhbloom->bits ? RHBLOOM_FUPGRADED : 0) | 
+        (rhbloom->pmask == rhbloom->m-1 ? 0 : RHBLOOM_FBLOCKED) |
+        (rhbloom->counting ? RHBLOOM_FCOUNTING : 0) |
+        (rhbloom->fpbits && rhbloom->fpwidth == 32 ? RHBLOOM_FCOMPRESS32 : 0) |
+        (rhbloom->fpbits && rhbloom->fpwidth == 16 ? RHBLOOM_FCOMPRESS16 : 0);
+}
+
+// Payload of rhbloom_serialize, the bloom words or the buckets.
+static uint64_t *rhbloom_payload(struct rhbloom *rhbloom, size_t *nwords) {
+    *nwords = (rhbloom->bits ? rhbloom_bitsize(rhbloom) : 
+        rhbloom->nbuckets ? rhbloom_tablesize(rhbloom, rhbloom->nbuckets) : 
+        0) >> 3;
+    return rhbloom->bits ? rhbloom->bits : rhbloom->buckets;
+}
+
+// Write the header for a payload of nwords, which must already follow it.
+static void rhbloom_write_header(struct rhbloom *rhbloom, uint8_t *hdr, 
+    uint32_t flags, size_t nwords)
+{
+    memset(hdr, 0, RHBLOOM_HDRSIZE);
+    memcpy(hdr, RHBLOOM_MAGIC, sizeof(RHBLOOM_MAGIC));
+    rhbloom_write64(hdr+8, RHBLOOM_VERSION | (uint64_t)flags << 32);
+    rhbloom_write64(hdr+16, rhbloom->k);
+    rhbloom_write64(hdr+24, rhbloom->m);
+    rhbloom_write64(hdr+32, rhbloom->count);
+    rhbloom_write64(hdr+40, rhbloom->nbuckets);
+    rhbloom_write64(hdr+48, nwords * 8);
+    uint64_t sum = rhbloom_checksum(0, hdr, 7);
+    sum = rhbloom_checksum(sum, hdr+RHBLOOM_HDRSIZE, nwords);
+    rhbloom_write64(hdr+56, sum);
+}
+
+/// Write the filter to a buffer.
+/// Not safe to call during adds on a concurrent filter.
+/// @param buf destination buffer, may be NULL when len is zero
+/// @param len size of the buffer
+/// @return the serialized size. Nothing is written if larger than len.
+/// Zero for a scalable filter that has more than one layer.
+size_t rhbloom_serialize(struct rhbloom *rhbloom, void *buf, size_t len) {
+    if (rhbloom->prev) {
+        return 0;
+    }
+    rhbloom_migrate_all(rhbloom);
+    size_t nwords;
+    uint64_t *payload = rhbloom_payload(rhbloom, &nwords);
+    size_t size = RHBLOOM_HDRSIZE + nwords * 8;
+    if (len < size) {
+        return size;
+    }
+    uint8_t *hdr = buf;
+    rhbloom_copy64(hdr+RHBLOOM_HDRSIZE, payload, nwords);
+    rhbloom_write_header(rhbloom, hdr, rhbloom_flags(rhbloom), nwords);
+    return size;
+}
+
+// Parsed and validated header
+struct rhbloom_header {
+    uint32_t flags;
+    size_t k;
+    size_t m;
+    size_t count;
+    size_t nbuckets;
+    size_t nwords;      // payload words, after the ids of a delta
+    uint64_t since;     // snapshot id that a delta applies to, 0 when full
+    uint64_t id;        // snapshot id after a delta
+};
+
+// Read the header of serialized data, or of a delta when delta is true.
+static bool rhbloom_read_header(const uint8_t *data, size_t len, bool delta,
+    struct rhbloom_header *hdr)
+{
+    if (len < RHBLOOM_HDRSIZE || 
+        memcmp(data, RHBLOOM_MAGIC, sizeof(RHBLOOM_MAGIC)) != 0)
+    {
+        return false;
+    }
+    uint64_t vf = rhbloom_read64(data+8);
+    uint64_t k = rhbloom_read64(data+16);
+    uint64_t m = rhbloom_read64(data+24);
+    uint64_t count = rhbloom_read64(data+32);
+    uint64_t nbuckets = rhbloom_read64(data+40);
+    uint64_t size = rhbloom_read64(data+48);
+    uint32_t flags = vf >> 32;
+    if ((uint32_t)vf != RHBLOOM_VERSION || 
+        (flags & ~(RHBLOOM_FUPGRADED|RHBLOOM_FBLOCKED|RHBLOOM_FCOUNTING|
+            RHBLOOM_FCOMPRESS32|RHBLOOM_FCOMPRESS16|RHBLOOM_FDELTA)) ||
+        !(flags & RHBLOOM_FDELTA) != !delta ||
+        k < 1 || k > 64 || m < 64 || m > SIZE_MAX/2 || (m & (m-1)) || 
+        ((flags & RHBLOOM_FBLOCKED) && m < RHBLOOM_BLOCKBITS))
+    {
+        return false;
+    }
+    size_t bitsize = (flags & RHBLOOM_FCOUNTING) ? m >> 1 : m >> 3;
+    int fpwidth = rhbloom_header_fpwidth(flags);
+    int fpbits = 0;
+    if (fpwidth) {
+        fpbits = rhbloom_fingerprint(bitsize, fpwidth);
+        if (fpwidth < 0 || !fpbits) {
+            return false;
+        }
+    }
+    uint64_t since = 0;
+    uint64_t id = 0;
+    size_t skip = 0;
+    if (delta) {
+        if (size < 16 || (size & 7) || len < RHBLOOM_HDRSIZE + 16) {
+            return false;
+        }
+        since = rhbloom_read64(data+RHBLOOM_HDRSIZE);
+        id = rhbloom_read64(data+RHBLOOM_HDRSIZE+8);
+        skip = 16;
+        size -= 16;
+        if (!id || (since && id != since + 1)) {
+            return false;
+        }
+    }
+    if (since) {
+        // The entries of a partial delta are checked as they're applied.
+        if (size > len - RHBLOOM_HDRSIZE - skip) {
+            return false;
+        }
+    } else if (flags & RHBLOOM_FUPGRADED) {
+        if (count || nbuckets || size != bitsize) {
+            return false;
+        }
+    } else if (nbuckets == 0) {
+        if (count || size) {
+            return false;
+        }
+    } else if (nbuckets < 16 || (nbuckets & (nbuckets-1)) || 
+        nbuckets > SIZE_MAX/16 || count >= nbuckets || 
+        size != nbuckets * rhbloom_slotbits_for(fpbits, fpwidth, nbuckets) / 8
+        || (fpbits && size >= bitsize))
+    {
+        return false;
+    }
+    if (len < RHBLOOM_HDRSIZE + skip + size) {
+        return false;
+    }
+    hdr->flags = flags;
+    hdr->k = k;
+    hdr->m = m;
+    hdr->count = count;
+    hdr->nbuckets = nbuckets;
+    hdr->nwords = size / 8;
+    hdr->since = since;
+    hdr->id = id;
+    return true;
+}
+
+// Returns true if the buckets hold exactly the count of the header, which
+// is below nbuckets. That leaves an empty bucket to end every probe.
+static bool rhbloom_check_buckets(struct rhbloom *rhbloom, uint64_t *buckets,
+    const struct rhbloom_header *hdr)
+{
+    struct rhbloom_table t = rhbloom_table(rhbloom, buckets, hdr->nbuckets);
+    size_t count = 0;
+    for (size_t i = 0; i < hdr->nbuckets; i++) {
+        count += RHBLOOM_DIB(rhbloom_get(&t, i)) != 0;
+    }
+    return count == hdr->count;
+}
+
+// Replace the contents of the filter with a serialized payload of the same
+// layout. The filter is unchanged if out of memory, or if the buckets don't
+// match the header.
+static bool rhbloom_load(struct rhbloom *rhbloom, 
+    const struct rhbloom_header *hdr, const uint8_t *payload)
+{
+    uint64_t *buckets = 0;
+    if (hdr->flags & RHBLOOM_FUPGRADED) {
+        if (!rhbloom->bits) {
+            rhbloom->bits = rhbloom_bits_alloc(rhbloom, &rhbloom->bitsmem);
+            if (!rhbloom->bits) {
+                return false;
+            }
+        }
+        rhbloom_copy64(rhbloom->bits, payload, hdr->nwords);
+    } else {
+        if (hdr->nbuckets) {
+            buckets = rhbloom_buckets_alloc(rhbloom, hdr->nwords << 3);
+            if (!buckets) {
+                return false;
+            }
+            rhbloom_copy64(buckets, payload, hdr->nwords);
+            if (!rhbloom_check_buckets(rhbloom, buckets, hdr)) {
+                rhbloom_buckets_free(rhbloom, buckets);
+                return false;
+            }
+        }
+        rhbloom_bits_free(rhbloom);
+        rhbloom->bits = 0;
+    }
+    rhbloom_buckets_free(rhbloom, rhbloom->buckets_old);
+    rhbloom->buckets_old = 0;
+    rhbloom->nbuckets_old = 0;
+    rhbloom->migrated = 0;
+    rhbloom->nold = 0;
+    rhbloom_buckets_free(rhbloom, rhbloom->buckets);
+    rhbloom->buckets = buckets;
+    rhbloom->nbuckets = hdr->nbuckets;
+    rhbloom->count = hdr->count;
+    rhbloom_recount(rhbloom);
+    return true;
+}
+
+/// Read a filter from a buffer that was written by rhbloom_serialize.
+/// The layout of the filter comes from the buffer, while the allocator,
+/// concurrency, and incremental growth come from the options.
+/// @param opts options, or NULL for defaults
+/// @return NULL if the data is invalid, corrupted, or out of memory
+struct rhbloom *rhbloom_deserialize(const void *data, size_t len, 
+    const struct rhbloom_options *opts)
+{
+    struct rhbloom_options defopts = { 0 };
+    opts = opts ? opts : &defopts;
+    struct rhbloom_header hdr;
+    if (!rhbloom_read_header(data, len, false, &hdr)) {
+        return 0;
+    }
+    const uint8_t *payload = (const uint8_t*)data + RHBLOOM_HDRSIZE;
+    uint64_t sum = rhbloom_checksum(0, data, 7);
+    sum = rhbloom_checksum(sum, payload, hdr.nwords);
+    if (sum != rhbloom_read64((const uint8_t*)data+56)) {
+        return 0;
+    }
+    struct rhbloom_options lopts = *opts;
+    lopts.counting = hdr.flags & RHBLOOM_FCOUNTING;
+    lopts.scalable = false;
+    lopts.compressed = rhbloom_header_fpwidth(hdr.flags) != 0;
+    struct rhbloom *rhbloom = rhbloom_alloc(hdr.k, hdr.m, 
+        hdr.flags & RHBLOOM_FBLOCKED, &lopts);
+    if (!rhbloom) {
+        return 0;
+    }
+    if (rhbloom_header_fpwidth(hdr.flags)) {
+        rhbloom_compress(rhbloom, rhbloom_header_fpwidth(hdr.flags));
+    }
+    if (!rhbloom_load(rhbloom, &hdr, payload)) {
+        rhbloom_free(rhbloom);
+        return 0;
+    }
+    return rhbloom;
+}
+
+/// Write bare bloom bits in the serialized format, as an upgraded filter
+/// with the layout k, m, and blocked. This is how the fixed filters of
+/// rhbloom_fixed.h share data with dynamic filters.
+/// @param bits m bits as u64 words, in the layout that rhbloom_add uses
+/// @return the number of bytes needed, or 0 if out of memory
+size_t rhbloom_serialize_bits(const uint64_t *bits, size_t k, size_t m, 
+    bool blocked, void *buf, size_t len)
+{
+    struct rhbloom_options opts = { 0 };
+    struct rhbloom *rhbloom = rhbloom_alloc(k, m, blocked, &opts);
+    if (!rhbloom) {
+        return 0;
+    }
+    // Borrow the bits, serialize only reads them.
+    rhbloom->bits = (uint64_t*)bits;
+    size_t size = rhbloom_serialize(rhbloom, buf, len);
+    rhbloom->bits = 0;
+    rhbloom_free(rhbloom);
+    return size;
+}
+
+/// Read the bloom bits of a serialized filter with the layout k, m, and
+/// blocked. A filter that is still a hashmap has its keys replayed into the
+/// bits, the same as an upgrade would.
+/// @param bits receives m bits as u64 words
+/// @return false if the data is invalid, corrupted, has another layout, is
+/// counting or compressed, or out of memory
+bool rhbloom_deserialize_bits(const void *data, size_t len, size_t k, 
+    size_t m, bool blocked, uint64_t *bits)
+{
+    struct rhbloom *rhbloom = rhbloom_deserialize(data, len, 0);
+    if (!rhbloom) {
+        return false;
+    }
+    bool ok = rhbloom->k == k && rhbloom->m == m && 
+        (rhbloom->pmask != m-1) == blocked && !rhbloom->counting && 
+        !rhbloom->fpbits && (rhbloom->bits || rhbloom_upgrade(rhbloom));
+    if (ok) {
+        memcpy(bits, rhbloom->bits, m >> 3);
+    }
+    rhbloom_free(rhbloom);
+    return ok;
+}
+
+/// Open a read-only view of serialized filter data, such as a memory mapped
+/// file. The bits or buckets are used in place and never copied, so the data
+/// must stay alive and unchanged until the view is freed. Only the small
+/// filter struct is allocated.
+/// The checksum is not verified, because that would touch every page. Use
+/// rhbloom_deserialize for data that is not trusted.
+/// Adds always fail on a view.
+/// @param data serialized filter that is aligned to at least 8 bytes, 64
+/// bytes for the full benefit of a blocked layout
+/// @return NULL if the data is invalid, misaligned, or out of memory
+struct rhbloom *rhbloom_open_view(const void *data, size_t len) {
+#ifdef RHBLOOM_BIG_ENDIAN
+    // The payload is little-endian and can't be used in place.
+    (void)data, (void)len;
+    return 0;
+#else
+    struct rhbloom_header hdr;
+    if (((uintptr_t)data & 7) || 
+        !rhbloom_read_header(data, len, false, &hdr))
+    {
+        return 0;
+    }
+    struct rhbloom_options opts = { 0 };
+    opts.counting = hdr.flags & RHBLOOM_FCOUNTING;
+    struct rhbloom *rhbloom = rhbloom_alloc(hdr.k, hdr.m, 
+        hdr.flags & RHBLOOM_FBLOCKED, &opts);
+    if (!rhbloom) {
+        return 0;
+    }
+    if (rhbloom_header_fpwidth(hdr.flags)) {
+        rhbloom_compress(rhbloom, rhbloom_header_fpwidth(hdr.flags));
+    }
+    uint64_t *payload = (uint64_t*)((uint8_t*)data + RHBLOOM_HDRSIZE);
+    rhbloom->view = true;
+    if (hdr.flags & RHBLOOM_FUPGRADED) {
+        rhbloom->bits = payload;
+    } else if (hdr.nbuckets) {
+        rhbloom->buckets = payload;
+        rhbloom->nbuckets = hdr.nbuckets;
+        rhbloom->count = hdr.count;
+    }
+    return rhbloom;
+#endif
+}
+
+// Start tracking the changes since a new snapshot.
+static void rhbloom_track(struct rhbloom *rhbloom) {
+    rhbloom->overflow = false;
+    rhbloom->nlog = 0;
+    if (!rhbloom->bits) {
+        return;
+    }
+    size_t size = (rhbloom_nblocks(rhbloom) + 63) / 64 * 8;
+    if (rhbloom->dirty) {
+        memset(rhbloom->dirty, 0, size);
+    } else {
+        rhbloom->dirty = rhbloom_zalloc(rhbloom, size);
+        rhbloom->overflow = !rhbloom->dirty;
+    }
+}
+
+// Number of bloom words in a delta block.
+static size_t rhbloom_blockwords(struct rhbloom *rhbloom, size_t block) {
+    size_t nwords = rhbloom_bitsize(rhbloom) >> 3;
+    size_t start = block * (RHBLOOM_DELTABLOCK/8);
+    return nwords - start < RHBLOOM_DELTABLOCK/8 ? nwords - start : 
+        RHBLOOM_DELTABLOCK/8;
+}
+
+/// Returns the id of the last snapshot that the filter wrote with
+/// rhbloom_delta or took from rhbloom_apply_delta, or 0 for none.
+uint64_t rhbloom_snapshot(struct rhbloom *rhbloom) {
+    return rhbloom->snapshot;
+}
+
+/// Write the changes to the filter since the snapshot id since, for a
+/// replica that is at that snapshot, and start a new snapshot.
+/// In the hashmap phase that is the keys added since, and in the bloom phase
+/// the blocks of RHBLOOM_DELTABLOCK bytes that changed. A full copy of the
+/// filter is written instead when since is 0 or not the last snapshot, or
+/// after an upgrade, a clear, a reset, a merge, or a delete from the
+/// hashmap. So is a hashmap whose changes outgrew the table.
+/// Once written, the filter is at snapshot rhbloom_snapshot, which is one
+/// more than before.
+/// Only for filters that were created with opts->tracking.
+/// @param buf destination buffer, may be NULL when len is zero
+/// @param len size of the buffer
+/// @return the size of the delta, which is in the serialized format. Nothing
+/// is written if larger than len. Zero without tracking.
+size_t rhbloom_delta(struct rhbloom *rhbloom, uint64_t since, void *buf, 
+    size_t len)
+{
+    if (!rhbloom->tracking) {
+        return 0;
+    }
+    rhbloom_migrate_all(rhbloom);
+    bool full = !since || since != rhbloom->snapshot || rhbloom->overflow;
+    size_t nblocks = rhbloom->bits ? rhbloom_nblocks(rhbloom) : 0;
+    size_t nwords = 2;
+    if (full) {
+        size_t npayload;
+        rhbloom_payload(rhbloom, &npayload);
+        nwords += npayload;
+    } else if (rhbloom->bits) {
+        for (size_t i = 0; i < nblocks; i++) {
+            if ((rhbloom->dirty[i>>6] >> (i&63)) & 1) {
+                nwords += 1 + rhbloom_blockwords(rhbloom, i);
+            }
+        }
+    } else {
+        nwords += rhbloom->nlog;
+    }
+    size_t size = RHBLOOM_HDRSIZE + nwords * 8;
+    if (len < size) {
+        return size;
+    }
+    uint8_t *hdr = buf;
+    uint8_t *p = hdr + RHBLOOM_HDRSIZE;
+    rhbloom_write64(p, full ? 0 : since);
+    rhbloom_write64(p+8, rhbloom->snapshot + 1);
+    p += 16;
+    if (full) {
+        size_t npayload;
+        uint64_t *payload = rhbloom_payload(rhbloom, &npayload);
+        rhbloom_copy64(p, payload, npayload);
+    } else if (rhbloom->bits) {
+        for (size_t i = 0; i < nblocks; i++) {
+            if ((rhbloom->dirty[i>>6] >> (i&63)) & 1) {
+                size_t n = rhbloom_blockwords(rhbloom, i);
+                rhbloom_write64(p, i);
+                rhbloom_copy64(p+8, rhbloom->bits + i*(RHBLOOM_DELTABLOCK/8),
+                    n);
+                p += 8 + n*8;
+            }
+        }
+    } else {
+        rhbloom_copy64(p, rhbloom->keylog, rhbloom->nlog);
+    }
+    rhbloom_write_header(rhbloom, hdr, rhbloom_flags(rhbloom)|RHBLOOM_FDELTA,
+        nwords);
+    rhbloom->snapshot++;
+    rhbloom_track(rhbloom);
+    return size;
+}
+
+// Copy the changed blocks of a partial delta into the bloom bits, once all
+// of the entries check out.
+static bool rhbloom_apply_blocks(struct rhbloom *rhbloom, const uint8_t *p, 
+    size_t nwords)
+{
+    size_t nblocks = rhbloom_nblocks(rhbloom);
+    for (int pass = 0; pass < 2; pass++) {
+        size_t i = 0;
+        while (i < nwords) {
+            uint64_t block = rhbloom_read64(p+i*8);
+            if (block >= nblocks) {
+                return false;
+            }
+            size_t n = rhbloom_blockwords(rhbloom, block);
+            if (n > nwords - i - 1) {
+                return false;
+            }
+            if (pass == 1) {
+                uint64_t *words = rhbloom->bits + block*(RHBLOOM_DELTABLOCK/8);
+                rhbloom->nbits -= rhbloom_countwords(rhbloom, words, n);
+                rhbloom_copy64(words, p+i*8+8, n);
+                rhbloom->nbits += rhbloom_countwords(rhbloom, words, n);
+                if (rhbloom->dirty) {
+                    rhbloom->dirty[block>>6] |= UINT64_C(1) << (block&63);
+                }
+            }
+            i += 1 + n;
+        }
+    }
+    return true;
+}
+
+/// Bring a replica up to date with a delta from rhbloom_delta. The replica
+/// must have been created with the same n, p, and layout as the filter that
+/// wrote the delta, and a partial delta must apply to the snapshot that the
+/// replica is at. A full delta applies to any snapshot.
+/// Not safe during other operations on the filter.
+/// @return false if the data is invalid, corrupted, has another layout or
+/// snapshot, the filter is a view, concurrent, or scalable, or out of
+/// memory. When adding the keys of a hashmap runs out of memory, some keys
+/// may have been added, and a full delta brings the replica back.
+bool rhbloom_apply_delta(struct rhbloom *rhbloom, const void *data, 
+    size_t len)
+{
+    struct rhbloom_header hdr;
+    if (rhbloom->view || rhbloom->sync || rhbloom->scalable || 
+        !rhbloom_read_header(data, len, true, &hdr))
+    {
+        return false;
+    }
+    const uint8_t *payload = (const uint8_t*)data + RHBLOOM_HDRSIZE;
+    uint64_t sum = rhbloom_checksum(0, data, 7);
+    sum = rhbloom_checksum(sum, payload, hdr.nwords + 2);
+    if (sum != rhbloom_read64((const uint8_t*)data+56)) {
+        return false;
+    }
+    uint32_t layout = ~(RHBLOOM_FUPGRADED|RHBLOOM_FDELTA);
+    if (hdr.k != rhbloom->k || hdr.m != rhbloom->m || 
+        (hdr.flags & layout) != (rhbloom_flags(rhbloom) & layout) ||
+        (hdr.since && hdr.since != rhbloom->snapshot))
+    {
+        return false;
+    }
+    payload += 16;
+    rhbloom_migrate_all(rhbloom);
+    if (!hdr.since) {
+        if (!rhbloom_load(rhbloom, &hdr, payload)) {
+            return false;
+        }
+        rhbloom_untrack(rhbloom);
+    } else if (hdr.flags & RHBLOOM_FUPGRADED) {
+        if (!rhbloom->bits || 
+            !rhbloom_apply_blocks(rhbloom, payload, hdr.nwords))
+        {
+            return false;
+        }
+    } else {
+        // Replayed keys are logged, and an upgraded replica takes them too.
+        for (size_t i = 0; i < hdr.nwords; i++) {
+            if (!rhbloom_addhash(rhbloom, rhbloom_read64(payload+i*8))) {
+                return false;
+            }
+        }
+    }
+    rhbloom->snapshot = hdr.id;
+    return true;
+}
+
+static bool rhbloom_compatible(struct rhbloom *a, struct rhbloom *b) {
+    return a->k == b->k && a->m == b->m && a->pmask == b->pmask && 
+        a->counting == b->counting && a->fpbits == b->fpbits && 
+        a->fpwidth == b->fpwidth && !a->prev && !b->prev;
+}
+
+static void rhbloom_or_words(uint64_t *dst, const uint64_t *src, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        dst[i] |= src[i];
+    }
+}
+
+static void rhbloom_and_words(uint64_t *dst, const uint64_t *src, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        dst[i] &= src[i];
+    }
+}
+
+#ifdef RHBLOOM_X86_SIMD
+__attribute__((target("avx2")))
+static void rhbloom_or_words_avx2(uint64_t *dst, const uint64_t *src, 
+    size_t n)
+{
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(dst+i));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(src+i));
+        _mm256_storeu_si256((__m256i*)(dst+i), _mm256_or_si256(a, b));
+    }
+    rhbloom_or_words(dst+i, src+i, n-i);
+}
+
+__attribute__((target("avx2")))
+static void rhbloom_and_words_avx2(uint64_t *dst, const uint64_t *src, 
+    size_t n)
+{
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(dst+i));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(src+i));
+        _mm256_storeu_si256((__m256i*)(dst+i), _mm256_and_si256(a, b));
+    }
+    rhbloom_and_words(dst+i, src+i, n-i);
+}
+#endif
+
+static void rhbloom_merge_words(uint64_t *dst, const uint64_t *src, size_t n,
+    bool intersect)
+{
+#ifdef RHBLOOM_X86_SIMD
+    if (__builtin_cpu_supports("avx2")) {
+        if (intersect) {
+            rhbloom_and_words_avx2(dst, src, n);
+        } else {
+            rhbloom_or_words_avx2(dst, src, n);
+        }
+        return;
+    }
+#endif
+    if (intersect) {
+        rhbloom_and_words(dst, src, n);
+    } else {
+        rhbloom_or_words(dst, src, n);
+    }
+}
+
+// Sum the counters, saturating at RHBLOOM_COUNTMAX, or take the smaller one.
+static void rhbloom_merge_counters(uint64_t *dst, const uint64_t *src, 
+    size_t n, bool intersect)
+{
+    for (size_t i = 0; i < n; i++) {
+        uint64_t w = 0;
+        for (int shift = 0; shift < 64; shift += 4) {
+            uint64_t a = (dst[i] >> shift) & RHBLOOM_COUNTMAX;
+            uint64_t b = (src[i] >> shift) & RHBLOOM_COUNTMAX;
+            uint64_t c = intersect ? (a < b ? a : b) : 
+                (a + b > RHBLOOM_COUNTMAX ? RHBLOOM_COUNTMAX : a + b);
+            w |= c << shift;
+        }
+        dst[i] = w;
+    }
+}
+
+// Merge the bloom bits or counters of two upgraded filters.
+static void rhbloom_merge(struct rhbloom *dst, struct rhbloom *src, 
+    bool intersect)
+{
+    size_t n = rhbloom_bitsize(dst) >> 3;
+    if (dst->counting) {
+        rhbloom_merge_counters(dst->bits, src->bits, n, intersect);
+    } else {
+        rhbloom_merge_words(dst->bits, src->bits, n, intersect);
+    }
+    rhbloom_recount(dst);
+}
+
+/// Add all keys of the src filter to the dst filter.
+/// Both must have been created with the same n, p, and layout, and neither
+/// may have more than one scalable layer. Two bloom filters are merged word
+/// for word, or counter for counter. The keys of a hashmap are replayed into
+/// the other filter, and a hashmap dst is upgraded when src is a bloom.
+/// Not safe during other operations on either filter.
+/// @return false if the filters are incompatible, dst is a view, or out of
+/// memory
+bool rhbloom_union(struct rhbloom *dst, struct rhbloom *src) {
+    if (dst->view || !rhbloom_compatible(dst, src)) {
+        return false;
+    }
+    rhbloom_migrate_all(dst);
+    rhbloom_migrate_all(src);
+    if (dst == src) {
+        return true;
+    }
+    if (src->bits) {
+        if (!dst->bits && !rhbloom_upgrade(dst)) {
+            return false;
+        }
+        rhbloom_merge(dst, src, false);
+        rhbloom_untrack(dst);
+        dst->nkeys += src->nkeys;
+        return true;
+    }
+    struct rhbloom_table t = rhbloom_table(src, src->buckets, src->nbuckets);
+    for (size_t i = 0; i < src->nbuckets; i++) {
+        uint64_t entry = rhbloom_get(&t, i);
+        if (RHBLOOM_DIB(entry)) {
+            if (!rhbloom_addhash(dst, entry)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/// Remove all keys from the dst filter that are not in the src filter.
+/// Both must have been created with the same n, p, and layout, and neither
+/// may have more than one scalable layer. Two bloom filters are intersected
+/// word for word, or counter for counter. When either one is still a
+/// hashmap the result is a hashmap, holding the keys of that hashmap which
+/// also test positive in the other filter.
+/// Not safe during other operations on either filter.
+/// @return false if the filters are incompatible, dst is a view, or out of
+/// memory
+bool rhbloom_intersect(struct rhbloom *dst, struct rhbloom *src) {
+    if (dst->view || !rhbloom_compatible(dst, src)) {
+        return false;
+    }
+    rhbloom_migrate_all(dst);
+    rhbloom_migrate_all(src);
+    if (dst == src) {
+        return true;
+    }
+    rhbloom_untrack(dst);
+    if (dst->bits && src->bits) {
+        rhbloom_merge(dst, src, true);
+        // Which keys are in both isn't known, so the count that a scalable
+        // layer fills up by is estimated from the bits that are left. It
+        // never grows.
+        double nkeys = rhbloom_layer_estimate(dst);
+        if (nkeys < (double)dst->nkeys) {
+            dst->nkeys = (size_t)(nkeys + 0.5);
+        }
+        return true;
+    }
+    // Build new buckets from the keys of the hashmap side.
+    struct rhbloom *keys = dst->bits ? src : dst;
+    struct rhbloom *other = dst->bits ? dst : src;
+    size_t nbuckets = keys->nbuckets;
+    uint64_t *buckets = 0;
+    size_t count = 0;
+    if (nbuckets) {
+        buckets = rhbloom_buckets_alloc(dst, rhbloom_tablesize(dst, nbuckets));
+        if (!buckets) {
+            return false;
+        }
+        struct rhbloom_table kt = rhbloom_table(keys, keys->buckets, nbuckets);
+        struct rhbloom_table t = rhbloom_table(dst, buckets, nbuckets);
+        for (size_t i = 0; i < nbuckets; i++) {
+            uint64_t key = rhbloom_get(&kt, i);
+            if (RHBLOOM_DIB(key) && rhbloom_testhash(other, key)) {
+                int res = rhbloom_insert(&t, key);
+                if (res < 0) {
+                    rhbloom_buckets_free(dst, buckets);
+                    return false;
+                }
+                count += res;
+            }
+        }
+    }
+    rhbloom_buckets_free(dst, dst->buckets);
+    rhbloom_bits_free(dst);
+    dst->bits = 0;
+    rhbloom_recount(dst);
+    dst->buckets = buckets;
+    dst->nbuckets = nbuckets;
+    dst->count = count;
+    return true;
+}
+
+// Number of keys per thread that rhbloom_build handles at a time.
+#define RHBLOOM_BUILD_CHUNK 65536
+#define RHBLOOM_BUILD_MAXTHREADS 256
+
+struct rhbloom_build_ctx {
+    struct rhbloom *rhbloom;
+    struct rhbloom_build_ctx *all;
+    int tid;
+    int nthreads;
+    int nregions;
+    int shift;              // bit position >> shift is the region
+    const uint64_t *keys;   // keys for this thread
+    size_t nkeys;
+    uint64_t *tmp;          // bit positions in key order
+    uint64_t *pos;          // bit positions in region order
+    size_t *offs;           // start of each region in pos, nregions+1
+};
+
+// Compute the bit positions of every key and partition them by region.
+static void *rhbloom_build_partition(void *arg) {
+    struct rhbloom_build_ctx *ctx = arg;
+    struct rhbloom *rhbloom = ctx->rhbloom;
+    size_t k = rhbloom->k;
+    uint64_t *tmp = ctx->tmp;
+    for (size_t i = 0; i < ctx->nkeys; i++) {
+        uint64_t key = RHBLOOM_KEY(rhbloom_hash(rhbloom, ctx->keys[i]));
+        size_t j = key & (rhbloom->m-1);
+        size_t base = j & ~rhbloom->pmask;
+        *tmp++ = j;
+        for (size_t p = 1; p < k; p++) {
+            key = rhbloom_next(key);
+            *tmp++ = base | (key & rhbloom->pmask);
+        }
+    }
+    size_t npos = ctx->nkeys * k;
+    memset(ctx->offs, 0, (ctx->nregions+1) * sizeof(size_t));
+    for (size_t i = 0; i < npos; i++) {
+        ctx->offs[(ctx->tmp[i] >> ctx->shift) + 1]++;
+    }
+    for (int r = 0; r < ctx->nregions; r++) {
+        ctx->offs[r+1] += ctx->offs[r];
+    }
+    for (size_t i = 0; i < npos; i++) {
+        size_t r = ctx->tmp[i] >> ctx->shift;
+        ctx->pos[ctx->offs[r]++] = ctx->tmp[i];
+    }
+    // The scatter moved each offset to the start of the next region.
+    memmove(ctx->offs+1, ctx->offs, ctx->nregions * sizeof(size_t));
+    ctx->offs[0] = 0;
+    return 0;
+}
+
+// Set the bits of the regions owned by this thread, taking the positions
+// from every thread. No other thread writes to these regions.
+static void *rhbloom_build_fill(void *arg) {
+    struct rhbloom_build_ctx *ctx = arg;
+    uint64_t *bits = ctx->rhbloom->bits;
+    for (int r = ctx->tid; r < ctx->nregions; r += ctx->nthreads) {
+        for (int t = 0; t < ctx->nthreads; t++) {
+            struct rhbloom_build_ctx *src = &ctx->all[t];
+            for (size_t i = src->offs[r]; i < src->offs[r+1]; i++) {
+                size_t j = src->pos[i];
+                bits[j>>6] |= UINT64_C(1)<<(j&63);
+            }
+        }
+    }
+    return 0;
+}
+
+// Run a build phase on all threads, falling back to the calling thread for
+// any thread that could not be started.
+static void rhbloom_build_run(struct rhbloom_build_ctx *ctxs, int nthreads,
+    void *(*fn)(void*))
+{
+#ifdef RHBLOOM_ATOMICS
+    pthread_t threads[nthreads];
+    bool started[nthreads];
+    for (int i = 1; i < nthreads; i++) {
+        started[i] = pthread_create(&threads[i], 0, fn, &ctxs[i]) == 0;
+        if (!started[i]) {
+            fn(&ctxs[i]);
+        }
+    }
+    fn(&ctxs[0]);
+    for (int i = 1; i < nthreads; i++) {
+        if (started[i]) {
+            pthread_join(threads[i], 0);
+        }
+    }
+#else
+    for (int i = 0; i < nthreads; i++) {
+        fn(&ctxs[i]);
+    }
+#endif
+}
+
+// Fill the bloom bits of an upgraded filter using many threads.
+static bool rhbloom_build_bits(struct rhbloom *rhbloom, const uint64_t *keys, 
+    size_t n, int nthreads)
+{
+    // Regions are a power of two and at least one block in size
+    int nregions = 1;
+    int shift = 0;
+    while (((size_t)1 << shift) < rhbloom->m) {
+        shift++;
+    }
+    while (nregions < nthreads && (rhbloom->m / nregions) > RHBLOOM_BLOCKBITS) {
+        nregions *= 2;
+        shift--;
+    }
+    struct rhbloom_build_ctx *ctxs = 
+        rhbloom_malloc(rhbloom, nthreads * sizeof(struct rhbloom_build_ctx));
+    if (!ctxs) {
+        return false;
+    }
+    memset(ctxs, 0, nthreads * sizeof(struct rhbloom_build_ctx));
+    size_t npos = RHBLOOM_BUILD_CHUNK * rhbloom->k;
+    bool ok = true;
+    for (int i = 0; i < nthreads; i++) {
+        ctxs[i].rhbloom = rhbloom;
+        ctxs[i].all = ctxs;
+        ctxs[i].tid = i;
+        ctxs[i].nthreads = nthreads;
+        ctxs[i].nregions = nregions;
+        ctxs[i].shift = shift;
+        ctxs[i].tmp = rhbloom_malloc(rhbloom, npos * sizeof(uint64_t));
+        ctxs[i].pos = rhbloom_malloc(rhbloom, npos * sizeof(uint64_t));
+        ctxs[i].offs = rhbloom_malloc(rhbloom, (nregions+1) * sizeof(size_t));
+        ok = ok && ctxs[i].tmp && ctxs[i].pos && ctxs[i].offs;
+    }
+    for (size_t i = 0; ok && i < n; ) {
+        for (int t = 0; t < nthreads; t++) {
+            size_t nkeys = n - i < RHBLOOM_BUILD_CHUNK ? n - i : 
+                RHBLOOM_BUILD_CHUNK;
+            ctxs[t].keys = keys + i;
+            ctxs[t].nkeys = nkeys;
+            i += nkeys;
+        }
+        rhbloom_build_run(ctxs, nthreads, rhbloom_build_partition);
+        rhbloom_build_run(ctxs, nthreads, rhbloom_build_fill);
+    }
+    for (int i = 0; i < nthreads; i++) {
+        if (ctxs[i].tmp) rhbloom_dealloc(rhbloom, ctxs[i].tmp);
+        if (ctxs[i].pos) rhbloom_dealloc(rhbloom, ctxs[i].pos);
+        if (ctxs[i].offs) rhbloom_dealloc(rhbloom, ctxs[i].offs);
+    }
+    rhbloom_dealloc(rhbloom, ctxs);
+    rhbloom_recount(rhbloom);
+    return ok;
+}
+
+/// Create a filter that holds all of the keys, using many threads.
+/// When n keys would upgrade the filter, the hashmap phase is skipped and
+/// the bloom bits are filled directly. The bits are split into regions, one
+/// set per thread, and threads partition the bit positions of their keys by
+/// region. This way each thread writes to its own regions without atomics.
+/// Duplicate keys count towards n. Counting filters are filled by the
+/// calling thread.
+/// @param nthreads number of threads, the calling thread is one of them
+/// @param opts options, or NULL for defaults
+/// @return NULL if out of memory
+struct rhbloom *rhbloom_build_with_options(const uint64_t *keys, size_t n, 
+    double p, int nthreads, const struct rhbloom_options *opts)
+{
+    struct rhbloom *rhbloom = rhbloom_new_with_options(n, p, opts);
+    if (!rhbloom) {
+        return 0;
+    }
+    if (n <= rhbloom_hashmap_cap(rhbloom) || rhbloom->counting) {
+        if (!rhbloom_reserve(rhbloom, n) || 
+            !rhbloom_add_batch(rhbloom, keys, n))
+        {
+            rhbloom_free(rhbloom);
+            return 0;
+        }
+        return rhbloom;
+    }
+    rhbloom->bits = rhbloom_bits_alloc(rhbloom, &rhbloom->bitsmem);
+    nthreads = nthreads < 1 ? 1 : nthreads;
+    nthreads = nthreads > RHBLOOM_BUILD_MAXTHREADS ? 
+        RHBLOOM_BUILD_MAXTHREADS : nthreads;
+    if (!rhbloom->bits || !rhbloom_build_bits(rhbloom, keys, n, nthreads)) {
+        rhbloom_free(rhbloom);
+        return 0;
+    }
+    rhbloom->nkeys = n;
+    return rhbloom;
+}
+
+/// Create a filter that holds all of the keys, using many threads.
+/// See rhbloom_build_with_options.
+struct rhbloom *rhbloom_build(const uint64_t *keys, size_t n, double p, 
+    int nthreads)
+{
+    return rhbloom_build_with_options(keys, n, p, nthreads, 0);
+}
+
+// A number of independent filters, with keys routed by the top bits of their
+// mix. Each filter only keeps the low 56 bits of the mix, so the routing is
+// independent of the buckets and bloom bits within a shard.
+struct rhbloom_sharded {
+    size_t nshards;     // power of two, at most RHBLOOM_MAXSHARDS
+    int shift;          // 64 minus log2 of nshards
+    struct rhbloom *shards[];
+};
+
+#define RHBLOOM_MAXSHARDS 256
+
+/// Create a filter that is split into shards, each a filter of its own with
+/// a capacity of n/nshards keys and the false positive rate p. Keys are
+/// routed to shards by their hash, so writers that each own a shard don't
+/// share cache lines, and small shards stay in the hashmap phase longer.
+/// @param nshards number of shards, rounded up to a power of two, at most 256
+/// @param opts options of every shard, or NULL for defaults
+/// @return NULL if out of memory or the options are invalid
+struct rhbloom_sharded *rhbloom_sharded_new(size_t n, double p, 
+    size_t nshards, const struct rhbloom_options *opts)
+{
+    size_t nshards_pow2 = 1;
+    int shift = 64;
+    nshards = nshards < 1 ? 1 : nshards;
+    nshards = nshards > RHBLOOM_MAXSHARDS ? RHBLOOM_MAXSHARDS : nshards;
+    while (nshards_pow2 < nshards) {
+        nshards_pow2 <<= 1;
+        shift--;
+    }
+    nshards = nshards_pow2;
+    size_t nshard = (n + nshards - 1) / nshards;
+    struct rhbloom *first = rhbloom_new_with_options(nshard, p, opts);
+    if (!first) {
+        return 0;
+    }
+    struct rhbloom_sharded *sharded = rhbloom_malloc(first, 
+        sizeof(struct rhbloom_sharded) + nshards*sizeof(struct rhbloom*));
+    if (!sharded) {
+        rhbloom_free(first);
+        return 0;
+    }
+    sharded->nshards = nshards;
+    sharded->shift = shift;
+    sharded->shards[0] = first;
+    for (size_t i = 1; i < nshards; i++) {
+        sharded->shards[i] = rhbloom_new_with_options(nshard, p, opts);
+        if (!sharded->shards[i]) {
+            sharded->nshards = i;
+            rhbloom_sharded_free(sharded);
+            return 0;
+        }
+    }
+    return sharded;
+}
+
+/// Free the sharded filter and all of its shards.
+void rhbloom_sharded_free(struct rhbloom_sharded *sharded) {
+    for (size_t i = 1; i < sharded->nshards; i++) {
+        rhbloom_free(sharded->shards[i]);
+    }
+    // The first shard allocated the sharded filter.
+    struct rhbloom *first = sharded->shards[0];
+    rhbloom_dealloc(first, sharded);
+    rhbloom_free(first);
+}
+
+/// Returns the number of shards.
+size_t rhbloom_sharded_nshards(struct rhbloom_sharded *sharded) {
+    return sharded->nshards;
+}
+
+// Index of the shard for a mixed key, from its high bits. The shards only
+// use the low 56 bits, so the routing doesn't skew the keys of a shard.
+static size_t rhbloom_sharded_route(struct rhbloom_sharded *sharded, 
+    uint64_t mixed)
+{
+    return sharded->shift == 64 ? 0 : (size_t)(mixed >> sharded->shift);
+}
+
+/// Returns the index of the shard that the key belongs to.
+size_t rhbloom_sharded_index(struct rhbloom_sharded *sharded, uint64_t key) {
+    return rhbloom_sharded_route(sharded, rhbloom_mix(key));
+}
+
+/// Returns the shard at index. A writer that owns a shard can add its keys,
+/// those with that rhbloom_sharded_index, to the shard directly. Adds to a
+/// shard from more than one thread need the concurrent option.
+struct rhbloom *rhbloom_sharded_shard(struct rhbloom_sharded *sharded, 
+    size_t index)
+{
+    return index < sharded->nshards ? sharded->shards[index] : 0;
+}
+
+/// Add a key to its shard.
+/// @return false if out of memory
+bool rhbloom_sharded_add(struct rhbloom_sharded *sharded, uint64_t key) {
+    // Mix once, for both the routing and the shard.
+    uint64_t mixed = rhbloom_mix(key);
+    struct rhbloom *shard = sharded->shards[rhbloom_sharded_route(sharded, 
+        mixed)];
+    return rhbloom_addhash(shard, mixed & shard->fpmask);
+}
+
+/// Test if a key is probably in its shard.
+bool rhbloom_sharded_test(struct rhbloom_sharded *sharded, uint64_t key) {
+    uint64_t mixed = rhbloom_mix(key);
+    struct rhbloom *shard = sharded->shards[rhbloom_sharded_route(sharded, 
+        mixed)];
+    return rhbloom_testhash(shard, mixed & shard->fpmask);
+}
+
+/// Remove all keys from every shard.
+void rhbloom_sharded_clear(struct rhbloom_sharded *sharded) {
+    for (size_t i = 0; i < sharded->nshards; i++) {
+        rhbloom_clear(sharded->shards[i]);
+    }
+}
+
+/// Returns the memory used by the sharded filter and all of its shards.
+size_t rhbloom_sharded_memsize(struct rhbloom_sharded *sharded) {
+    size_t size = sizeof(struct rhbloom_sharded) + 
+        sharded->nshards*sizeof(struct rhbloom*);
+    for (size_t i = 0; i < sharded->nshards; i++) {
+        size += rhbloom_memsize(sharded->shards[i]);
+    }
+    return size;
+}
+
+// A ring of filters, one per generation. Keys are added to the newest and
+// tested against all of them. Every filter has the same options, and so the
+// same hash of a key.
+struct rhbloom_window {
+    size_t ngens;       // number of generations
+    size_t newest;      // index of the newest generation
+    struct rhbloom *gens[];
+};
+
+/// Create a sliding window filter that keeps ngens generations of keys.
+/// Each generation is a filter of its own, with the capacity n and a false
+/// positive rate of p/ngens, so that a test of all generations has the rate
+/// p. Generations start out as empty hashmaps, which take next to no memory
+/// until keys are added.
+/// @param ngens number of generations, at least one
+/// @param opts options of every generation, or NULL for defaults. The
+/// scalable option is applied to each generation.
+/// @return NULL if out of memory or the options are invalid
+struct rhbloom_window *rhbloom_window_new(size_t n, double p, size_t ngens,
+    const struct rhbloom_options *opts)
+{
+    ngens = ngens < 1 ? 1 : ngens;
+    p /= (double)ngens;
+    struct rhbloom *first = rhbloom_new_with_options(n, p, opts);
+    if (!first) {
+        return 0;
+    }
+    struct rhbloom_window *window = rhbloom_malloc(first, 
+        sizeof(struct rhbloom_window) + ngens*sizeof(struct rhbloom*));
+    if (!window) {
+        rhbloom_free(first);
+        return 0;
+    }
+    window->ngens = ngens;
+    window->newest = 0;
+    window->gens[0] = first;
+    for (size_t i = 1; i < ngens; i++) {
+        window->gens[i] = rhbloom_new_with_options(n, p, opts);
+        if (!window->gens[i]) {
+            window->ngens = i;
+            rhbloom_window_free(window);
+            return 0;
+        }
+    }
+    return window;
+}
+
+/// Free the window filter and all of its generations.
+void rhbloom_window_free(struct rhbloom_window *window) {
+    for (size_t i = 1; i < window->ngens; i++) {
+        rhbloom_free(window->gens[i]);
+    }
+    // The first generation allocated the window.
+    struct rhbloom *first = window->gens[0];
+    rhbloom_dealloc(first, window);
+    rhbloom_free(first);
+}
+
+/// Returns the number of generations.
+size_t rhbloom_window_ngens(struct rhbloom_window *window) {
+    return window->ngens;
+}
+
+/// Returns a generation, where 0 is the newest and ngens-1 the oldest.
+struct rhbloom *rhbloom_window_gen(struct rhbloom_window *window, 
+    size_t age)
+{
+    if (age >= window->ngens) {
+        return 0;
+    }
+    return window->gens[(window->newest + window->ngens - age) % 
+        window->ngens];
+}
+
+/// Start a new generation. The oldest generation is reset, dropping its
+/// keys and memory, and becomes the newest. Calling this every t seconds
+/// makes a window of the keys that were added in the last ngens*t seconds,
+/// give or take t.
+void rhbloom_window_rotate(struct rhbloom_window *window) {
+    window->newest = (window->newest + 1) % window->ngens;
+    rhbloom_reset(window->gens[window->newest]);
+}
+
+/// Add a key to the newest generation.
+/// @return false if out of memory
+bool rhbloom_window_add(struct rhbloom_window *window, uint64_t key) {
+    return rhbloom_add(window->gens[window->newest], key);
+}
+
+/// Test if a key is probably in any of the generations.
+/// The key is hashed once for all generations, newest first.
+bool rhbloom_window_test(struct rhbloom_window *window, uint64_t key) {
+    key = rhbloom_hash(window->gens[0], key);
+    for (size_t age = 0; age < window->ngens; age++) {
+        if (rhbloom_testhash(rhbloom_window_gen(window, age), key)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/// Adds many keys to the newest generation, like rhbloom_add_batch.
+/// @return true if all keys were added or false if out of memory
+bool rhbloom_window_add_batch(struct rhbloom_window *window, 
+    const uint64_t *keys, size_t n)
+{
+    return rhbloom_add_batch(window->gens[window->newest], keys, n);
+}
+
+/// Check if many keys are probably in any of the generations, like
+/// rhbloom_test_batch. Each batch of keys is hashed once, and tested against
+/// the generations one at a time.
+/// @param out receives the rhbloom_window_test result for each key
+void rhbloom_window_test_batch(struct rhbloom_window *window, 
+    const uint64_t *keys, size_t n, bool *out)
+{
+    uint64_t hashes[RHBLOOM_BATCH];
+    bool found[RHBLOOM_BATCH];
+    for (size_t i = 0; i < n; i += RHBLOOM_BATCH) {
+        size_t nb = n - i < RHBLOOM_BATCH ? n - i : RHBLOOM_BATCH;
+        for (size_t j = 0; j < nb; j++) {
+            hashes[j] = rhbloom_hash(window->gens[0], keys[i+j]);
+        }
+        rhbloom_testhash_batch(window->gens[window->newest], hashes, nb, 
+            out+i);
+        for (size_t age = 1; age < window->ngens; age++) {
+            rhbloom_testhash_batch(rhbloom_window_gen(window, age), hashes, 
+                nb, found);
+            for (size_t j = 0; j < nb; j++) {
+                out[i+j] = out[i+j] || found[j];
+            }
+        }
+    }
+}
+
+/// Remove all keys from every generation, resetting each one.
+void rhbloom_window_clear(struct rhbloom_window *window) {
+    for (size_t i = 0; i < window->ngens; i++) {
+        rhbloom_reset(window->gens[i]);
+    }
+}
+
+/// Returns the memory used by the window filter and all of its generations.
+size_t rhbloom_window_memsize(struct rhbloom_window *window) {
+    size_t size = sizeof(struct rhbloom_window) + 
+        window->ngens*sizeof(struct rhbloom*);
+    for (size_t i = 0; i < window->ngens; i++) {
+        size += rhbloom_memsize(window->gens[i]);
+    }
+    return size;
 }
@@ -13,15 +13,142 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 struct rhbloom;
+struct rhbloom_sharded;
+struct rhbloom_window;
+
+// Allocator with a user context, such as an arena or a pool
+struct rhbloom_allocator {
+    void*(*malloc)(size_t size, void *udata);
+    void(*free)(void *ptr, void *udata);
+    void *udata;             // passed to every call
+};
+
+// Pages that back the bloom bits, see rhbloom_options
+enum rhbloom_pages {
+    RHBLOOM_PAGES_DEFAULT = 0, // the allocator's memory
+    RHBLOOM_PAGES_HUGE = 1,    // transparent huge pages
+    RHBLOOM_PAGES_2MB = 2,     // reserved 2 MB huge pages, else transparent
+    RHBLOOM_PAGES_1GB = 3,     // reserved 1 GB huge pages, else 2 MB
+};
+
+// NUMA placement of the bloom bits, see rhbloom_options
+enum rhbloom_numa {
+    RHBLOOM_NUMA_DEFAULT = 0,    // the memory policy of the process
+    RHBLOOM_NUMA_INTERLEAVE = 1, // spread the pages over all nodes
+    RHBLOOM_NUMA_BIND = 2,       // keep the pages on numa_node
+};
+
+struct rhbloom_options {
+    void*(*malloc)(size_t);  // custom allocator, default is stdlib malloc
+    void(*free)(void*);      // custom allocator, default is stdlib free
+    const struct rhbloom_allocator *allocator; // overrides malloc and free
+    bool blocked;            // keep all bits of a key in one 64-byte block
+    bool concurrent;         // allow adds and tests from many threads
+    bool incremental;        // spread each grow over the following operations
+    bool scalable;           // keep adding bloom layers past n keys
+    bool counting;           // 4-bit counters after upgrade, for deletes
+    bool compressed;         // pack the hashmap into narrow slots
+    bool branchless;         // test all k bits, for mixed hits and misses
+    enum rhbloom_pages pages; // page size of the bloom bits, Linux only
+    enum rhbloom_numa numa;  // numa policy of the bloom bits, Linux only
+    int numa_node;           // node for RHBLOOM_NUMA_BIND
+    double load_factor;      // max load of the hashmap, default 0.5
+    double upgrade_ratio;    // upgrade at this table to bloom size, default 1
+    size_t memory_budget;    // upgrade before the table passes these bytes
+    bool tracking;           // track changes for rhbloom_delta
+};
+
+// Result of rhbloom_test_ex
+enum rhbloom_result {
+    RHBLOOM_ABSENT = 0,      // definitely not in the filter
+    RHBLOOM_PRESENT = 1,     // added, up to a 56-bit hash collision
+    RHBLOOM_PROBABLE = 2,    // probably added, may be a false positive
+};
+
+// Pending lookup, see rhbloom_lookup_begin
+struct rhbloom_lookup {
+    uint64_t hash;           // mixed key
+};
+
+// Snapshot of the instrumentation counters, see rhbloom_stats
+struct rhbloom_stats {
+    uint64_t probes;         // hashmap probes by adds and tests
+    uint64_t probe_length;   // buckets visited by those probes
+    uint64_t max_probe;      // longest probe
+    double avg_probe;        // average probe length
+    uint64_t bloom_tests;    // tests of the bloom bits
+    uint64_t bloom_bits;     // bits read by those tests
+    double avg_bits;         // average bits read per test
+    uint64_t grows;          // number of grows, including the upgrade
+    uint64_t grow_ns;        // nanoseconds spent growing
+    uint64_t upgrade_ns;     // unix time of the upgrade in nanoseconds, or 0
+};
 
 struct rhbloom *rhbloom_new(size_t n, double p);
 struct rhbloom *rhbloom_new_with_allocator(size_t n, double p, void*(*malloc)(size_t), void(*free)(void*));
+struct rhbloom *rhbloom_new_with_options(size_t n, double p, const struct rhbloom_options *opts);
 void rhbloom_free(struct rhbloom *rhbloom);
 void rhbloom_clear(struct rhbloom *rhbloom);
+void rhbloom_reset(struct rhbloom *rhbloom);
 bool rhbloom_add(struct rhbloom *rhbloom, uint64_t key);
 bool rhbloom_test(struct rhbloom *rhbloom, uint64_t key);
+enum rhbloom_result rhbloom_test_ex(struct rhbloom *rhbloom, uint64_t key);
+struct rhbloom_lookup rhbloom_lookup_begin(struct rhbloom *rhbloom, uint64_t key);
+struct rhbloom_lookup rhbloom_lookup_begin_bytes(struct rhbloom *rhbloom, const void *data, size_t len);
+bool rhbloom_lookup_finish(struct rhbloom *rhbloom, struct rhbloom_lookup lookup);
+bool rhbloom_delete(struct rhbloom *rhbloom, uint64_t key);
+bool rhbloom_reserve(struct rhbloom *rhbloom, size_t n);
+bool rhbloom_add_batch(struct rhbloom *rhbloom, const uint64_t *keys, size_t n);
+void rhbloom_test_batch(struct rhbloom *rhbloom, const uint64_t *keys, size_t n, bool *out);
+bool rhbloom_add_bytes(struct rhbloom *rhbloom, const void *data, size_t len);
+bool rhbloom_test_bytes(struct rhbloom *rhbloom, const void *data, size_t len);
+bool rhbloom_add_bytes_batch(struct rhbloom *rhbloom, const void *const *keys, const size_t *lens, size_t n);
+void rhbloom_test_bytes_batch(struct rhbloom *rhbloom, const void *const *keys, const size_t *lens, size_t n, bool *out);
 size_t rhbloom_memsize(struct rhbloom *rhbloom);
 bool rhbloom_upgraded(struct rhbloom *rhbloom);
+size_t rhbloom_count_estimate(struct rhbloom *rhbloom);
+double rhbloom_fpr_estimate(struct rhbloom *rhbloom);
+bool rhbloom_stats(struct rhbloom *rhbloom, struct rhbloom_stats *stats);
+size_t rhbloom_serialize(struct rhbloom *rhbloom, void *buf, size_t len);
+struct rhbloom *rhbloom_deserialize(const void *data, size_t len, const struct rhbloom_options *opts);
+struct rhbloom *rhbloom_open_view(const void *data, size_t len);
+uint64_t rhbloom_snapshot(struct rhbloom *rhbloom);
+size_t rhbloom_delta(struct rhbloom *rhbloom, uint64_t since, void *buf, size_t len);
+bool rhbloom_apply_delta(struct rhbloom *rhbloom, const void *data, size_t len);
+size_t rhbloom_serialize_bits(const uint64_t *bits, size_t k, size_t m, bool blocked, void *buf, size_t len);
+bool rhbloom_deserialize_bits(const void *data, size_t len, size_t k, size_t m, bool blocked, uint64_t *bits);
+bool rhbloom_union(struct rhbloom *dst, struct rhbloom *src);
+bool rhbloom_intersect(struct rhbloom *dst, struct rhbloom *src);
+struct rhbloom *rhbloom_build(const uint64_t *keys, size_t n, double p, int nthreads);
+struct rhbloom *rhbloom_build_with_options(const uint64_t *keys, size_t n, double p, int nthreads, const struct rhbloom_options *opts);
+struct rhbloom_sharded *rhbloom_sharded_new(size_t n, double p, size_t nshards, const struct rhbloom_options *opts);
+void rhbloom_sharded_free(struct rhbloom_sharded *sharded);
+size_t rhbloom_sharded_nshards(struct rhbloom_sharded *sharded);
+size_t rhbloom_sharded_index(struct rhbloom_sharded *sharded, uint64_t key);
+struct rhbloom *rhbloom_sharded_shard(struct rhbloom_sharded *sharded, size_t index);
+bool rhbloom_sharded_add(struct rhbloom_sharded *sharded, uint64_t key);
+bool rhbloom_sharded_test(struct rhbloom_sharded *sharded, uint64_t key);
+void rhbloom_sharded_clear(struct rhbloom_sharded *sharded);
+size_t rhbloom_sharded_memsize(struct rhbloom_sharded *sharded);
+struct rhbloom_window *rhbloom_window_new(size_t n, double p, size_t ngens, const struct rhbloom_options *opts);
+void rhbloom_window_free(struct rhbloom_window *window);
+size_t rhbloom_window_ngens(struct rhbloom_window *window);
+struct rhbloom *rhbloom_window_gen(struct rhbloom_window *window, size_t age);
+void rhbloom_window_rotate(struct rhbloom_window *window);
+bool rhbloom_window_add(struct rhbloom_window *window, uint64_t key);
+bool rhbloom_window_test(struct rhbloom_window *window, uint64_t key);
+bool rhbloom_window_add_batch(struct rhbloom_window *window, const uint64_t *keys, size_t n);
+void rhbloom_window_test_batch(struct rhbloom_window *window, const uint64_t *keys, size_t n, bool *out);
+void rhbloom_window_clear(struct rhbloom_window *window);
+size_t rhbloom_window_memsize(struct rhbloom_window *window);
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif // RHBLOOM_H
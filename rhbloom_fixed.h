@@ -0,0 +1,126 @@
+// https://github.com/tidwall/rhbloom
+//
+// Copyright 2024 Joshua J Baker. All rights reserved.
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file.
+//
+// rhbloom_fixed: Bloom filters with a fixed k and m.
+//
+// A plain bloom filter, without the hashmap phase, whose k and m are known at
+// compile time. The probe loop is unrolled and the masks are constants, so
+// adds and tests inline into the caller. The bits are laid out exactly as the
+// bits of an upgraded struct rhbloom, and the serialized data is shared with
+// the dynamic filters.
+//
+//   RHBLOOM_FIXED(myfilter, 6, 20, false)  // k=6, m=2^20 bits, not blocked
+//
+//   static struct myfilter filter;
+//   myfilter_add(&filter, 12031);
+//   if (myfilter_test(&filter, 12031)) { ... }
+//
+// The serialize and deserialize functions need rhbloom.c. Everything else is
+// header-only.
+
+#ifndef RHBLOOM_FIXED_H
+#define RHBLOOM_FIXED_H
+
+#include <string.h>
+#include "rhbloom.h"
+
+#ifdef __cplusplus
+#define RHBLOOM_FIXED_ALIGNAS(n) alignas(n)
+#define RHBLOOM_FIXED_STATIC_ASSERT(cond, msg) static_assert(cond, msg)
+#else
+#define RHBLOOM_FIXED_ALIGNAS(n) _Alignas(n)
+#define RHBLOOM_FIXED_STATIC_ASSERT(cond, msg) _Static_assert(cond, msg)
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define RHBLOOM_FIXED_INLINE static inline __attribute__((always_inline))
+#define RHBLOOM_FIXED_UNROLL _Pragma("GCC unroll 32")
+#else
+#define RHBLOOM_FIXED_INLINE static inline
+#define RHBLOOM_FIXED_UNROLL
+#endif
+
+// Must match rhbloom_mix and rhbloom_next in rhbloom.c.
+RHBLOOM_FIXED_INLINE uint64_t rhbloom_fixed_mix(uint64_t key) {
+    key ^= key >> 30;
+    key *= UINT64_C(0xbf58476d1ce4e5b9);
+    key ^= key >> 27;
+    key *= UINT64_C(0x94d049bb133111eb);
+    key ^= key >> 31;
+    return key;
+}
+
+RHBLOOM_FIXED_INLINE uint64_t rhbloom_fixed_next(uint64_t key) {
+    key *= UINT64_C(0x94d049bb133111eb);
+    key ^= key >> 31;
+    return key;
+}
+
+// Add or test a key, following the probe sequence of rhbloom_testadd. The
+// k, m, and blocked arguments are constants in the generated functions.
+RHBLOOM_FIXED_INLINE bool rhbloom_fixed_testadd(uint64_t *bits, size_t k,
+    size_t m, bool blocked, uint64_t key, bool add)
+{
+    size_t pmask = blocked ? 511 : m-1;
+    key = rhbloom_fixed_mix(key) << 8 >> 8;
+    size_t j = key & (m-1);
+    size_t base = j & ~pmask;
+    RHBLOOM_FIXED_UNROLL
+    for (size_t i = 0; i < k; i++) {
+        if (i > 0) {
+            key = rhbloom_fixed_next(key);
+            j = base | (key & pmask);
+        }
+        uint64_t bit = UINT64_C(1) << (j & 63);
+        if (add) {
+            bits[j>>6] |= bit;
+        } else if (!(bits[j>>6] & bit)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Declares struct name and its functions, for a filter with K bits per key
+// and 2^LOG2_M bits total. LOG2_M is at least 6, or 9 when BLOCKED.
+#define RHBLOOM_FIXED(name, K, LOG2_M, BLOCKED)                               \
+struct name {                                                                 \
+    RHBLOOM_FIXED_ALIGNAS(64) uint64_t bits[((size_t)1 << (LOG2_M)) / 64];    \
+};                                                                            \
+RHBLOOM_FIXED_STATIC_ASSERT((K) >= 1 && (LOG2_M) >= ((BLOCKED) ? 9 : 6) &&    \
+    (LOG2_M) < 64, "invalid fixed rhbloom layout");                           \
+                                                                              \
+static inline void name##_clear(struct name *filter) {                        \
+    memset(filter->bits, 0, sizeof(filter->bits));                            \
+}                                                                             \
+                                                                              \
+static inline void name##_add(struct name *filter, uint64_t key) {            \
+    rhbloom_fixed_testadd(filter->bits, (K), (size_t)1 << (LOG2_M),           \
+        (BLOCKED), key, true);                                                \
+}                                                                             \
+                                                                              \
+static inline bool name##_test(struct name *filter, uint64_t key) {           \
+    return rhbloom_fixed_testadd(filter->bits, (K), (size_t)1 << (LOG2_M),    \
+        (BLOCKED), key, false);                                               \
+}                                                                             \
+                                                                              \
+/* Same as rhbloom_serialize, readable by rhbloom_deserialize. */             \
+static inline size_t name##_serialize(struct name *filter, void *buf,         \
+    size_t len)                                                               \
+{                                                                             \
+    return rhbloom_serialize_bits(filter->bits, (K), (size_t)1 << (LOG2_M),   \
+        (BLOCKED), buf, len);                                                 \
+}                                                                             \
+                                                                              \
+/* Reads data of the same layout from rhbloom_serialize. */                   \
+static inline bool name##_deserialize(struct name *filter, const void *data,  \
+    size_t len)                                                               \
+{                                                                             \
+    return rhbloom_deserialize_bits(data, len, (K), (size_t)1 << (LOG2_M),    \
+        (BLOCKED), filter->bits);                                             \
+}
+
+#endif // RHBLOOM_FIXED_H
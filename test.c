@@ -3,13 +3,19 @@
 // 
 // # run benchmarks
 // $ cc *.c && ./a.out bench
+//
+// # run the benchmark suite, one JSON object per line, up to maxn keys
+// # (default 1M, a few seconds, while 16M takes minutes)
+// $ cc -O3 -DNDEBUG *.c -lm -lpthread && ./a.out suite [maxn]
 
 #include <time.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <pthread.h>
 #include "rhbloom.h"
+#include "rhbloom_fixed.h"
 
 unsigned int murmurhash2(const void * key, int len, const unsigned int seed) {
     const unsigned int m = 0x5bd1e995;
@@ -113,6 +119,1669 @@ void test_step(struct rhbloom *rhbloom, int n, double p) {
     }
 }
 
+void test_blocked(void) {
+    for (int n = 0; n < 100000; n += 7000) {
+        for (double p = 0.01; p < 0.70; p += 0.05) {
+            struct rhbloom_options opts = { .blocked = true };
+            struct rhbloom *rhbloom = rhbloom_new_with_options(n, p, &opts);
+            assert(rhbloom);
+            test_step(rhbloom, n, p);
+            rhbloom_clear(rhbloom); 
+            test_step(rhbloom, n, p);
+            rhbloom_free(rhbloom);
+        }
+    }
+}
+
+void test_batch(void) {
+    int n = 50000;
+    uint64_t *keys = malloc(n*2*sizeof(uint64_t));
+    bool *out = malloc(n*2*sizeof(bool));
+    assert(keys && out);
+    for (int i = 0; i < n*2; i++) {
+        keys[i] = hash(i);
+    }
+    for (int blocked = 0; blocked < 2; blocked++) {
+        struct rhbloom_options opts = { .blocked = blocked };
+        struct rhbloom *rhbloom = rhbloom_new_with_options(n, 0.01, &opts);
+        assert(rhbloom);
+        // Add in uneven chunks to cross the upgrade in the middle of a batch.
+        for (int i = 0; i < n; i += 777) {
+            int nb = n - i < 777 ? n - i : 777;
+            assert(rhbloom_add_batch(rhbloom, keys+i, nb));
+            rhbloom_test_batch(rhbloom, keys, n*2, out);
+            for (int j = 0; j < n*2; j++) {
+                assert(out[j] == rhbloom_test(rhbloom, keys[j]));
+                if (j < i+nb) {
+                    assert(out[j]);
+                }
+            }
+        }
+        assert(rhbloom_upgraded(rhbloom));
+        rhbloom_free(rhbloom);
+    }
+    free(keys);
+    free(out);
+}
+
+#define CONCURRENT_THREADS 4
+#define CONCURRENT_KEYS 100000
+
+struct concurrent_ctx {
+    struct rhbloom *rhbloom;
+    int start;
+    int nkeys;
+};
+
+void *concurrent_worker(void *arg) {
+    struct concurrent_ctx *ctx = arg;
+    for (int i = ctx->start; i < ctx->start+ctx->nkeys; i++) {
+        assert(rhbloom_add(ctx->rhbloom, hash(i)));
+        assert(rhbloom_test(ctx->rhbloom, hash(i)));
+        // Keys that were added earlier must never go missing, even when the
+        // filter grows or upgrades in between.
+        int j = ctx->start + (i - ctx->start) / 2;
+        assert(rhbloom_test(ctx->rhbloom, hash(j)));
+    }
+    return 0;
+}
+
+void test_concurrent(void) {
+    // Small filters stay a hashmap, large ones upgrade during the run.
+    int nkeys[] = { 100, CONCURRENT_KEYS };
+    for (int mode = 0; mode < 3; mode++) {
+        for (int t = 0; t < 2; t++) {
+            int n = CONCURRENT_THREADS*nkeys[t];
+            struct rhbloom_options opts = { 
+                .blocked = mode == 1, 
+                .compressed = mode == 2,
+                .concurrent = true,
+            };
+            size_t cap = t == 0 ? n*100 : n;
+            struct rhbloom *rhbloom = rhbloom_new_with_options(cap, 0.01, 
+                &opts);
+            assert(rhbloom);
+            assert(!rhbloom_upgraded(rhbloom));
+            pthread_t threads[CONCURRENT_THREADS];
+            struct concurrent_ctx ctxs[CONCURRENT_THREADS];
+            for (int i = 0; i < CONCURRENT_THREADS; i++) {
+                ctxs[i].rhbloom = rhbloom;
+                ctxs[i].start = i*nkeys[t];
+                ctxs[i].nkeys = nkeys[t];
+                assert(!pthread_create(&threads[i], 0, concurrent_worker, 
+                    &ctxs[i]));
+            }
+            for (int i = 0; i < CONCURRENT_THREADS; i++) {
+                assert(!pthread_join(threads[i], 0));
+            }
+            assert(rhbloom_upgraded(rhbloom) == (t == 1));
+            for (int i = 0; i < n; i++) {
+                assert(rhbloom_test(rhbloom, hash(i)));
+            }
+            if (t == 0) {
+                for (int i = n; i < n*2; i++) {
+                    assert(!rhbloom_test(rhbloom, hash(i)));
+                }
+            }
+            rhbloom_free(rhbloom);
+        }
+    }
+}
+
+// Serialize and deserialize the filter, checking that every answer stays
+// the same. Returns the serialized data.
+void *serialize_roundtrip(struct rhbloom *rhbloom, int n, size_t *size) {
+    size_t len = rhbloom_serialize(rhbloom, 0, 0);
+    void *data = malloc(len);
+    assert(data);
+    assert(rhbloom_serialize(rhbloom, data, len) == len);
+    struct rhbloom *rhbloom2 = rhbloom_deserialize(data, len, 0);
+    assert(rhbloom2);
+    assert(rhbloom_upgraded(rhbloom2) == rhbloom_upgraded(rhbloom));
+    assert(rhbloom_memsize(rhbloom2) == rhbloom_memsize(rhbloom));
+    for (int i = 0; i < n*2; i++) {
+        assert(rhbloom_test(rhbloom2, hash(i)) == rhbloom_test(rhbloom, hash(i)));
+    }
+    // Deserialized filters keep working
+    assert(rhbloom_add(rhbloom2, hash(n*2)));
+    assert(rhbloom_test(rhbloom2, hash(n*2)));
+    rhbloom_free(rhbloom2);
+    *size = len;
+    return data;
+}
+
+// Write the checksum of serialized data again, after it was changed.
+void reseal(uint8_t *data, size_t len) {
+    uint64_t h = 0;
+    for (size_t i = 0; i < len/8; i++) {
+        if (i == 7) {
+            continue;
+        }
+        uint64_t x = 0;
+        for (int j = 0; j < 8; j++) {
+            x |= (uint64_t)data[i*8+j] << (j*8);
+        }
+        h = (h ^ x) * UINT64_C(0x9e3779b97f4a7c15);
+        h ^= h >> 32;
+    }
+    for (int j = 0; j < 8; j++) {
+        data[56+j] = h >> (j*8);
+    }
+}
+
+void test_serialize(void) {
+    for (int blocked = 0; blocked < 2; blocked++) {
+        for (int n = 0; n < 20000; n = n*2+1) {
+            struct rhbloom_options opts = { .blocked = blocked };
+            struct rhbloom *rhbloom = rhbloom_new_with_options(5000, 0.01, 
+                &opts);
+            assert(rhbloom);
+            for (int i = 0; i < n; i++) {
+                assert(rhbloom_add(rhbloom, hash(i)));
+            }
+            size_t len;
+            uint8_t *data = serialize_roundtrip(rhbloom, n, &len);
+            // Too small of a buffer writes nothing
+            assert(rhbloom_serialize(rhbloom, data, len-1) == len);
+            // Truncated or corrupted data is rejected
+            assert(!rhbloom_deserialize(data, len-1, 0));
+            for (size_t i = 0; i < len; i += len/7+1) {
+                data[i] ^= 0x10;
+                assert(!rhbloom_deserialize(data, len, 0));
+                data[i] ^= 0x10;
+            }
+            free(data);
+            rhbloom_free(rhbloom);
+        }
+    }
+    // A hashmap with no empty bucket is rejected, even with a good checksum,
+    // since the next add would probe forever.
+    {
+        struct rhbloom *rhbloom = rhbloom_new(1000, 0.01);
+        assert(rhbloom);
+        for (int i = 0; i < 10; i++) {
+            assert(rhbloom_add(rhbloom, hash(i)));
+        }
+        size_t len = rhbloom_serialize(rhbloom, 0, 0);
+        uint8_t *data = malloc(len);
+        assert(data);
+        rhbloom_serialize(rhbloom, data, len);
+        reseal(data, len);
+        struct rhbloom *rhbloom2 = rhbloom_deserialize(data, len, 0);
+        assert(rhbloom2);
+        rhbloom_free(rhbloom2);
+        for (size_t i = 64; i < len; i += 8) {
+            if (!data[i+7]) {
+                data[i] = i;
+                data[i+7] = 1;
+            }
+        }
+        reseal(data, len);
+        assert(!rhbloom_deserialize(data, len, 0));
+        free(data);
+        rhbloom_free(rhbloom);
+    }
+    // The format is stable, the same keys must always produce the same bytes.
+    uint64_t sums[2];
+    for (int upgrade = 0; upgrade < 2; upgrade++) {
+        struct rhbloom *rhbloom = rhbloom_new(1000, 0.01);
+        assert(rhbloom);
+        for (int i = 0; i < (upgrade ? 1000 : 10); i++) {
+            assert(rhbloom_add(rhbloom, i));
+        }
+        assert(rhbloom_upgraded(rhbloom) == upgrade);
+        size_t len = rhbloom_serialize(rhbloom, 0, 0);
+        uint8_t *data = malloc(len);
+        assert(data);
+        rhbloom_serialize(rhbloom, data, len);
+        sums[upgrade] = 0;
+        for (int i = 0; i < 8; i++) {
+            sums[upgrade] |= (uint64_t)data[56+i] << (i*8);
+        }
+        free(data);
+        rhbloom_free(rhbloom);
+    }
+    assert(sums[0] == UINT64_C(0xbe82d24e3725a2fc));
+    assert(sums[1] == UINT64_C(0xc917deb656df1cdc));
+}
+
+void test_view(void) {
+    for (int blocked = 0; blocked < 2; blocked++) {
+        for (int n = 0; n < 20000; n = n*4+1) {
+            struct rhbloom_options opts = { .blocked = blocked };
+            struct rhbloom *rhbloom = rhbloom_new_with_options(5000, 0.01, 
+                &opts);
+            assert(rhbloom);
+            for (int i = 0; i < n; i++) {
+                assert(rhbloom_add(rhbloom, hash(i)));
+            }
+            size_t len = rhbloom_serialize(rhbloom, 0, 0);
+            // Room for a misaligned copy too
+            uint64_t *data = malloc(len+8);
+            assert(data);
+            rhbloom_serialize(rhbloom, data, len);
+            struct rhbloom *view = rhbloom_open_view(data, len);
+            assert(view);
+            assert(rhbloom_upgraded(view) == rhbloom_upgraded(rhbloom));
+            bool out[64];
+            for (int i = 0; i < n*2; i++) {
+                assert(rhbloom_test(view, hash(i)) == 
+                    rhbloom_test(rhbloom, hash(i)));
+                if (i % 64 == 0) {
+                    uint64_t keys[64];
+                    for (int j = 0; j < 64; j++) {
+                        keys[j] = hash(i+j);
+                    }
+                    rhbloom_test_batch(view, keys, 64, out);
+                    for (int j = 0; j < 64; j++) {
+                        assert(out[j] == rhbloom_test(rhbloom, keys[j]));
+                    }
+                }
+            }
+            // Read-only
+            assert(!rhbloom_add(view, hash(n*2)));
+            rhbloom_clear(view);
+            assert(n == 0 || rhbloom_test(view, hash(0)));
+            rhbloom_free(view);
+            // Misaligned and truncated data is rejected
+            memmove((char*)data+1, data, len);
+            assert(!rhbloom_open_view((char*)data+1, len));
+            memmove(data, (char*)data+1, len);
+            assert(!rhbloom_open_view(data, len-1));
+            free(data);
+            rhbloom_free(rhbloom);
+        }
+    }
+}
+
+// Make a filter holding the keys from start to end.
+struct rhbloom *merge_filter(int start, int end, bool blocked) {
+    struct rhbloom_options opts = { .blocked = blocked };
+    struct rhbloom *rhbloom = rhbloom_new_with_options(20000, 0.01, &opts);
+    assert(rhbloom);
+    for (int i = start; i < end; i++) {
+        assert(rhbloom_add(rhbloom, hash(i)));
+    }
+    return rhbloom;
+}
+
+void test_merge(void) {
+    // Small sets stay a hashmap, large sets upgrade
+    int sizes[] = { 100, 15000 };
+    for (int blocked = 0; blocked < 2; blocked++) {
+        for (int a = 0; a < 2; a++) {
+            for (int b = 0; b < 2; b++) {
+                // The sets overlap by half of the smaller one.
+                int na = sizes[a], nb = sizes[b];
+                int bstart = na - (na < nb ? na : nb) / 2;
+                struct rhbloom *src = merge_filter(bstart, bstart+nb, blocked);
+                struct rhbloom *dst = merge_filter(0, na, blocked);
+                assert(rhbloom_union(dst, src));
+                assert(rhbloom_upgraded(dst) == (a || b));
+                for (int i = 0; i < bstart+nb; i++) {
+                    assert(rhbloom_test(dst, hash(i)));
+                }
+                rhbloom_free(dst);
+                dst = merge_filter(0, na, blocked);
+                assert(rhbloom_intersect(dst, src));
+                assert(rhbloom_upgraded(dst) == (a && b));
+                for (int i = bstart; i < na && i < bstart+nb; i++) {
+                    assert(rhbloom_test(dst, hash(i)));
+                }
+                // Counted as about the keys in both
+                int both = (na < bstart+nb ? na : bstart+nb) - bstart;
+                size_t est = rhbloom_count_estimate(dst);
+                assert(est >= (size_t)both*9/10 && est <= (size_t)both*12/10);
+                if (!a && !b) {
+                    // Two hashmaps intersect exactly
+                    for (int i = 0; i < bstart; i++) {
+                        assert(!rhbloom_test(dst, hash(i)));
+                    }
+                    for (int i = na; i < bstart+nb; i++) {
+                        assert(!rhbloom_test(dst, hash(i)));
+                    }
+                }
+                rhbloom_free(dst);
+                rhbloom_free(src);
+            }
+        }
+        // A scalable layer fills up by the keys left after intersecting, as
+        // estimated from its bits. Bits that only overlapped by chance count
+        // too, but far from all the keys that went in.
+        struct rhbloom_options opts = { .blocked = blocked, .scalable = true };
+        struct rhbloom *sa = rhbloom_new_with_options(10000, 0.01, &opts);
+        struct rhbloom *sb = rhbloom_new_with_options(10000, 0.01, &opts);
+        assert(sa && sb);
+        for (int i = 0; i < 9000; i++) {
+            assert(rhbloom_add(sa, hash(i)));
+            assert(rhbloom_add(sb, hash(i+8000)));
+        }
+        assert(rhbloom_intersect(sa, sb));
+        size_t est = rhbloom_count_estimate(sa);
+        assert(est >= 900 && est <= 4500);
+        for (int i = 0; i < 5000; i++) {
+            assert(rhbloom_add(sa, hash(100000+i)));
+        }
+        // Still one layer, which serializes
+        assert(rhbloom_serialize(sa, 0, 0) > 0);
+        rhbloom_free(sa);
+        rhbloom_free(sb);
+        // Incompatible filters
+        struct rhbloom *x = merge_filter(0, 10, blocked);
+        struct rhbloom *y = rhbloom_new(1000, 0.01);
+        assert(y);
+        assert(!rhbloom_union(x, y));
+        assert(!rhbloom_intersect(x, y));
+        rhbloom_free(x);
+        rhbloom_free(y);
+    }
+}
+
+void test_build(void) {
+    int sizes[] = { 0, 500, 300000 };
+    int threads[] = { 1, 3, 4 };
+    for (int blocked = 0; blocked < 2; blocked++) {
+        for (int s = 0; s < 3; s++) {
+            int n = sizes[s];
+            uint64_t *keys = malloc((n+1) * sizeof(uint64_t));
+            assert(keys);
+            for (int i = 0; i < n; i++) {
+                keys[i] = hash(i);
+            }
+            // A built filter is the same as one made by adding every key.
+            struct rhbloom_options opts = { .blocked = blocked };
+            struct rhbloom *rhbloom = rhbloom_new_with_options(n, 0.01, &opts);
+            assert(rhbloom);
+            assert(rhbloom_add_batch(rhbloom, keys, n));
+            size_t len = rhbloom_serialize(rhbloom, 0, 0);
+            void *data = malloc(len);
+            void *data2 = malloc(len);
+            assert(data && data2);
+            rhbloom_serialize(rhbloom, data, len);
+            for (int t = 0; t < 3; t++) {
+                struct rhbloom *built = rhbloom_build_with_options(keys, n, 
+                    0.01, threads[t], &opts);
+                assert(built);
+                assert(rhbloom_upgraded(built) == rhbloom_upgraded(rhbloom));
+                assert(rhbloom_serialize(built, data2, len) == len);
+                assert(memcmp(data, data2, len) == 0);
+                rhbloom_free(built);
+            }
+            free(data);
+            free(data2);
+            free(keys);
+            rhbloom_free(rhbloom);
+        }
+    }
+}
+
+int nallocs = 0;
+
+void *counting_malloc(size_t size) {
+    nallocs++;
+    return malloc(size);
+}
+
+void test_reserve(void) {
+    for (int n = 1; n < 100000; n *= 3) {
+        for (int upgrade = 0; upgrade < 2; upgrade++) {
+            // Sized so the keys either fit the hashmap or must upgrade
+            size_t cap = upgrade ? n : n*100;
+            struct rhbloom *rhbloom = rhbloom_new_with_allocator(cap, 0.01, 
+                counting_malloc, free);
+            assert(rhbloom);
+            assert(rhbloom_reserve(rhbloom, n));
+            int nallocs0 = nallocs;
+            for (int i = 0; i < n; i++) {
+                assert(rhbloom_add(rhbloom, hash(i)));
+            }
+            assert(nallocs == nallocs0);
+            bool upgraded = rhbloom_upgraded(rhbloom);
+            for (int i = 0; i < n*2; i++) {
+                assert(i >= n ? (upgraded || !rhbloom_test(rhbloom, hash(i))) :
+                    rhbloom_test(rhbloom, hash(i)));
+            }
+            // Reserving fewer is a no-op
+            assert(rhbloom_reserve(rhbloom, n/2));
+            assert(nallocs == nallocs0);
+            rhbloom_free(rhbloom);
+        }
+    }
+}
+
+void test_incremental(void) {
+    for (int n = 0; n < 100000; n += 7000) {
+        for (double p = 0.01; p < 0.70; p += 0.15) {
+            struct rhbloom_options opts = { .incremental = true };
+            struct rhbloom *rhbloom = rhbloom_new_with_options(n, p, &opts);
+            assert(rhbloom);
+            test_step(rhbloom, n, p);
+            rhbloom_clear(rhbloom); 
+            test_step(rhbloom, n, p);
+            rhbloom_free(rhbloom);
+        }
+    }
+    int n = 100000;
+    struct rhbloom_options opts = { .incremental = true };
+    struct rhbloom *rhbloom = rhbloom_new_with_options(n, 0.01, &opts);
+    struct rhbloom *expect = rhbloom_new(n, 0.01);
+    assert(rhbloom && expect);
+    for (int i = 0; i < n; i++) {
+        assert(rhbloom_add(rhbloom, hash(i)));
+        assert(rhbloom_add(expect, hash(i)));
+        // Keys stay visible while the old buckets are still migrating.
+        if ((i & (i+1)) == 0) {
+            for (int j = 0; j <= i; j++) {
+                assert(rhbloom_test(rhbloom, hash(j)));
+            }
+        }
+    }
+    // Once migrated, the bits are the same as growing all at once.
+    size_t len = rhbloom_serialize(expect, 0, 0);
+    void *data = malloc(len);
+    void *data2 = malloc(len);
+    assert(data && data2);
+    assert(rhbloom_serialize(expect, data, len) == len);
+    assert(rhbloom_serialize(rhbloom, data2, len) == len);
+    assert(memcmp(data, data2, len) == 0);
+    free(data);
+    free(data2);
+    rhbloom_free(rhbloom);
+    rhbloom_free(expect);
+    opts.concurrent = true;
+    assert(!rhbloom_new_with_options(n, 0.01, &opts));
+}
+
+void test_scalable(void) {
+    int n = 10000;
+    double p = 0.01;
+    for (int blocked = 0; blocked < 2; blocked++) {
+        struct rhbloom_options opts = { .scalable = true, .blocked = blocked };
+        struct rhbloom *rhbloom = rhbloom_new_with_options(n, p, &opts);
+        struct rhbloom *fixed = rhbloom_new(n, p);
+        assert(rhbloom && fixed);
+        // Go well past n keys.
+        int nn = n*20;
+        for (int i = 0; i < nn; i++) {
+            assert(rhbloom_add(rhbloom, hash(i)));
+            assert(rhbloom_add(fixed, hash(i)));
+        }
+        uint64_t *keys = malloc(nn * sizeof(uint64_t));
+        bool *out = malloc(nn * sizeof(bool));
+        assert(keys && out);
+        for (int i = 0; i < nn; i++) {
+            keys[i] = hash(i);
+        }
+        rhbloom_test_batch(rhbloom, keys, nn, out);
+        for (int i = 0; i < nn; i++) {
+            assert(rhbloom_test(rhbloom, hash(i)));
+            assert(out[i]);
+        }
+        int hits = 0;
+        int fixed_hits = 0;
+        for (int i = nn; i < nn*2; i++) {
+            hits += rhbloom_test(rhbloom, hash(i));
+            fixed_hits += rhbloom_test(fixed, hash(i));
+        }
+        // The fixed filter is saturated, the scalable one stays near p.
+        double rate = (double)hits / nn;
+        double limit = blocked ? p*2 : p*1.5;
+        if (rate > limit) {
+            printf("scalable rate %f\n", rate);
+            assert(!"bad probability");
+        }
+        assert(fixed_hits > hits * 10);
+        assert(rhbloom_memsize(rhbloom) > rhbloom_memsize(fixed));
+        // Layered filters can't be serialized or merged.
+        assert(rhbloom_serialize(rhbloom, 0, 0) == 0);
+        assert(!rhbloom_union(rhbloom, fixed));
+        // Clearing keeps only the newest layer.
+        size_t memsize = rhbloom_memsize(rhbloom);
+        rhbloom_clear(rhbloom);
+        assert(rhbloom_memsize(rhbloom) < memsize);
+        assert(rhbloom_serialize(rhbloom, 0, 0) > 0);
+        for (int i = 0; i < nn; i++) {
+            assert(rhbloom_add(rhbloom, hash(i)));
+        }
+        for (int i = 0; i < nn; i++) {
+            assert(rhbloom_test(rhbloom, hash(i)));
+        }
+        free(keys);
+        free(out);
+        rhbloom_free(rhbloom);
+        rhbloom_free(fixed);
+    }
+    struct rhbloom_options opts = { .scalable = true, .concurrent = true };
+    assert(!rhbloom_new_with_options(n, p, &opts));
+}
+
+void test_delete(void) {
+    int n = 20000;
+    for (int counting = 0; counting < 2; counting++) {
+        struct rhbloom_options opts = { .counting = counting };
+        struct rhbloom *rhbloom = rhbloom_new_with_options(n, 0.01, &opts);
+        assert(rhbloom);
+        // Exact while in the hashmap phase.
+        for (int i = 0; i < 500; i++) {
+            assert(rhbloom_add(rhbloom, hash(i)));
+        }
+        assert(!rhbloom_upgraded(rhbloom));
+        assert(!rhbloom_delete(rhbloom, hash(1000)));
+        for (int i = 0; i < 500; i += 2) {
+            assert(rhbloom_delete(rhbloom, hash(i)));
+            assert(!rhbloom_delete(rhbloom, hash(i)));
+        }
+        for (int i = 0; i < 500; i++) {
+            assert(rhbloom_test(rhbloom, hash(i)) == (i % 2 == 1));
+        }
+        // Deleted keys are gone after the upgrade too.
+        for (int i = 500; i < n; i++) {
+            assert(rhbloom_add(rhbloom, hash(i)));
+        }
+        assert(rhbloom_upgraded(rhbloom));
+        int hits = 0;
+        for (int i = 0; i < 500; i += 2) {
+            hits += rhbloom_test(rhbloom, hash(i));
+        }
+        assert(hits < 25);
+        if (!counting) {
+            assert(!rhbloom_delete(rhbloom, hash(501)));
+            rhbloom_free(rhbloom);
+            continue;
+        }
+        // Churn half of the keys out and new ones in.
+        for (int i = 1000; i < n; i += 2) {
+            assert(rhbloom_delete(rhbloom, hash(i)));
+            assert(rhbloom_add(rhbloom, hash(i+n)));
+        }
+        for (int i = 1000; i < n; i += 2) {
+            assert(rhbloom_test(rhbloom, hash(i+1)));
+            assert(rhbloom_test(rhbloom, hash(i+n)));
+        }
+        hits = 0;
+        for (int i = 1000; i < n; i += 2) {
+            hits += rhbloom_test(rhbloom, hash(i));
+        }
+        assert(hits < (n-1000)/2/20);
+        // Counters survive a round trip.
+        size_t len = rhbloom_serialize(rhbloom, 0, 0);
+        void *data = malloc(len);
+        assert(data);
+        assert(rhbloom_serialize(rhbloom, data, len) == len);
+        struct rhbloom *copy = rhbloom_deserialize(data, len, 0);
+        assert(copy);
+        for (int i = 1000; i < n; i += 2) {
+            assert(rhbloom_test(copy, hash(i+n)));
+            assert(rhbloom_delete(copy, hash(i+n)));
+        }
+        // Union sums the counters, so deleting from one side keeps a key.
+        assert(rhbloom_union(copy, rhbloom));
+        for (int i = 1000; i < n; i += 2) {
+            assert(rhbloom_test(copy, hash(i+n)));
+        }
+        free(data);
+        rhbloom_free(copy);
+        rhbloom_free(rhbloom);
+    }
+}
+
+// Number of keys added before the filter upgrades.
+int upgrade_point(double p, bool compressed) {
+    struct rhbloom_options opts = { .compressed = compressed };
+    struct rhbloom *rhbloom = rhbloom_new_with_options(1000000, p, &opts);
+    assert(rhbloom);
+    int i = 0;
+    while (!rhbloom_upgraded(rhbloom)) {
+        assert(rhbloom_add(rhbloom, hash(i)));
+        i++;
+    }
+    rhbloom_free(rhbloom);
+    return i;
+}
+
+void test_compressed(void) {
+    for (int n = 0; n < 100000; n += 7000) {
+        for (double p = 0.01; p < 0.70; p += 0.05) {
+            // Same as test_step, but the hashmap phase keeps fingerprints,
+            // which may have rare false positives.
+            struct rhbloom_options opts = { .compressed = true };
+            struct rhbloom *rhbloom = rhbloom_new_with_options(n, p, &opts);
+            assert(rhbloom);
+            int nn = n+1;
+            int hits = 0;
+            for (int i = 0; i < nn; i++) {
+                if (!rhbloom_upgraded(rhbloom)) {
+                    hits += rhbloom_test(rhbloom, hash(i));
+                }
+                rhbloom_add(rhbloom, hash(i));
+                assert(rhbloom_test(rhbloom, hash(i)));
+            }
+            assert(hits <= nn/1000);
+            assert(rhbloom_upgraded(rhbloom));
+            for (int i = 0; i < nn; i++) {
+                assert(rhbloom_test(rhbloom, hash(i)));
+            }
+            hits = 0;
+            for (int i = nn; i < nn*2; i++) {
+                hits += rhbloom_test(rhbloom, hash(i));
+            }
+            if (n > 0 && (double)hits/(double)n - p > 0.1) {
+                printf("n=%d p=%f hits=%d\n", n, p, hits);
+                assert(!"bad probability");
+            }
+            rhbloom_free(rhbloom);
+        }
+    }
+    // 32-bit slots hold twice the keys in the same memory, 16-bit slots
+    // four times.
+    assert(upgrade_point(0.01, true) >= upgrade_point(0.01, false) * 2 - 100);
+    assert(upgrade_point(0.05, true) >= upgrade_point(0.05, false) * 4 - 100);
+    for (int p = 0; p < 2; p++) {
+        struct rhbloom_options opts = { .compressed = true };
+        int n = 1000000;
+        struct rhbloom *rhbloom = rhbloom_new_with_options(n, p ? 0.05 : 0.01,
+            &opts);
+        assert(rhbloom);
+        int nn = 20000;
+        for (int i = 0; i < nn; i++) {
+            assert(rhbloom_add(rhbloom, hash(i)));
+        }
+        assert(!rhbloom_upgraded(rhbloom));
+        for (int i = 0; i < nn; i += 2) {
+            assert(rhbloom_delete(rhbloom, hash(i)));
+        }
+        int hits = 0;
+        for (int i = 0; i < nn; i++) {
+            bool yes = rhbloom_test(rhbloom, hash(i));
+            assert(i % 2 == 0 || yes);
+            hits += i % 2 == 0 && yes;
+        }
+        for (int i = nn; i < nn*10; i++) {
+            hits += rhbloom_test(rhbloom, hash(i));
+        }
+        assert(hits < nn*10/1000);
+        // Narrow slots survive a round trip.
+        size_t len = rhbloom_serialize(rhbloom, 0, 0);
+        void *data = malloc(len);
+        assert(data);
+        assert(rhbloom_serialize(rhbloom, data, len) == len);
+        struct rhbloom *copy = rhbloom_deserialize(data, len, 0);
+        struct rhbloom *view = rhbloom_open_view(data, len);
+        assert(copy && view);
+        for (int i = 0; i < nn*2; i++) {
+            bool yes = rhbloom_test(rhbloom, hash(i));
+            assert(rhbloom_test(copy, hash(i)) == yes);
+            assert(rhbloom_test(view, hash(i)) == yes);
+        }
+        // Keys carry over into the bloom filter.
+        for (int i = nn; i < n; i++) {
+            assert(rhbloom_add(copy, hash(i)));
+        }
+        assert(rhbloom_upgraded(copy));
+        for (int i = 1; i < n; i += i < nn ? 2 : 1) {
+            assert(rhbloom_test(copy, hash(i)));
+        }
+        rhbloom_free(view);
+        rhbloom_free(copy);
+        rhbloom_free(rhbloom);
+        free(data);
+    }
+    struct rhbloom_options opts = { .compressed = true, .incremental = true };
+    assert(!rhbloom_new_with_options(1000, 0.01, &opts));
+}
+
+void test_ex(void) {
+    for (int compressed = 0; compressed < 2; compressed++) {
+        struct rhbloom_options opts = { .compressed = compressed };
+        int n = 10000;
+        struct rhbloom *rhbloom = rhbloom_new_with_options(n, 0.01, &opts);
+        assert(rhbloom);
+        enum rhbloom_result hit = compressed ? RHBLOOM_PROBABLE : 
+            RHBLOOM_PRESENT;
+        int i = 0;
+        for (; i < 200; i++) {
+            assert(rhbloom_add(rhbloom, hash(i)));
+        }
+        assert(!rhbloom_upgraded(rhbloom));
+        for (int j = 0; j < i; j++) {
+            assert(rhbloom_test_ex(rhbloom, hash(j)) == hit);
+        }
+        for (int j = n; j < n*2; j++) {
+            assert(rhbloom_test_ex(rhbloom, hash(j)) == RHBLOOM_ABSENT);
+        }
+        for (; i < n; i++) {
+            assert(rhbloom_add(rhbloom, hash(i)));
+        }
+        assert(rhbloom_upgraded(rhbloom));
+        for (int j = 0; j < n*2; j++) {
+            enum rhbloom_result res = rhbloom_test_ex(rhbloom, hash(j));
+            assert(res != RHBLOOM_PRESENT);
+            assert((res == RHBLOOM_PROBABLE) == rhbloom_test(rhbloom, hash(j)));
+        }
+        rhbloom_free(rhbloom);
+    }
+}
+
+void test_estimate(void) {
+    for (int mode = 0; mode < 5; mode++) {
+        struct rhbloom_options opts = { 
+            .blocked = mode == 1, .counting = mode == 2, 
+            .concurrent = mode == 3, .incremental = mode == 4,
+        };
+        int n = 100000;
+        struct rhbloom *rhbloom = rhbloom_new_with_options(n, 0.01, &opts);
+        assert(rhbloom);
+        assert(rhbloom_count_estimate(rhbloom) == 0);
+        assert(rhbloom_fpr_estimate(rhbloom) == 0);
+        int i = 0;
+        for (; !rhbloom_upgraded(rhbloom); i++) {
+            assert(rhbloom_count_estimate(rhbloom) == (size_t)i);
+            assert(rhbloom_add(rhbloom, hash(i)));
+            assert(rhbloom_add(rhbloom, hash(i)));
+        }
+        for (; i < n; i++) {
+            assert(rhbloom_add(rhbloom, hash(i)));
+            if (i == n/2 || i == n-1) {
+                double est = rhbloom_count_estimate(rhbloom);
+                assert(est > (i+1)*0.97 && est < (i+1)*1.03);
+            }
+        }
+        int hits = 0;
+        for (int j = n; j < n*2; j++) {
+            hits += rhbloom_test(rhbloom, hash(j));
+        }
+        double fpr = rhbloom_fpr_estimate(rhbloom);
+        double real = (double)hits / n;
+        assert(fpr > real*0.7 && fpr < real*1.4);
+        if (mode == 2) {
+            for (int j = 0; j < n; j++) {
+                assert(rhbloom_delete(rhbloom, hash(j)));
+            }
+            assert(rhbloom_count_estimate(rhbloom) < (size_t)(n/100));
+        }
+        rhbloom_free(rhbloom);
+    }
+
+    // Recounted after merges, deserializing, and for views
+    int n = 10000;
+    struct rhbloom *a = rhbloom_new(n, 0.01);
+    struct rhbloom *b = rhbloom_new(n, 0.01);
+    assert(a && b);
+    for (int i = 0; i < n/2; i++) {
+        assert(rhbloom_add(a, hash(i)));
+        assert(rhbloom_add(b, hash(i+n/4)));
+    }
+    assert(rhbloom_union(a, b));
+    double est = rhbloom_count_estimate(a);
+    assert(est > n*0.75*0.97 && est < n*0.75*1.03);
+    size_t len = rhbloom_serialize(a, 0, 0);
+    void *buf = aligned_alloc(64, (len+63)&~(size_t)63);
+    assert(buf && rhbloom_serialize(a, buf, len) == len);
+    struct rhbloom *c = rhbloom_deserialize(buf, len, 0);
+    struct rhbloom *v = rhbloom_open_view(buf, len);
+    assert(c && v);
+    assert(rhbloom_count_estimate(c) == rhbloom_count_estimate(a));
+    assert(rhbloom_count_estimate(v) == rhbloom_count_estimate(a));
+    assert(rhbloom_fpr_estimate(v) == rhbloom_fpr_estimate(a));
+    assert(rhbloom_intersect(a, b));
+    est = rhbloom_count_estimate(a);
+    assert(est > n*0.5*0.97 && est < n*0.5*1.03);
+    rhbloom_clear(a);
+    assert(rhbloom_count_estimate(a) == 0);
+    rhbloom_free(v);
+    rhbloom_free(c);
+    rhbloom_free(b);
+    rhbloom_free(a);
+    free(buf);
+
+    // Scalable layers are summed
+    struct rhbloom_options opts = { .scalable = true };
+    struct rhbloom *rhbloom = rhbloom_new_with_options(n, 0.01, &opts);
+    assert(rhbloom);
+    for (int i = 0; i < n*8; i++) {
+        assert(rhbloom_add(rhbloom, hash(i)));
+    }
+    est = rhbloom_count_estimate(rhbloom);
+    assert(est > n*8*0.95 && est < n*8*1.05);
+    double fpr = rhbloom_fpr_estimate(rhbloom);
+    assert(fpr > 0.001 && fpr < 0.02);
+    rhbloom_free(rhbloom);
+}
+
+void test_stats(void) {
+    for (int concurrent = 0; concurrent < 2; concurrent++) {
+        struct rhbloom_options opts = { .concurrent = concurrent };
+        struct rhbloom *rhbloom = rhbloom_new_with_options(1000, 0.01, &opts);
+        assert(rhbloom);
+        struct rhbloom_stats stats;
+        if (!rhbloom_stats(rhbloom, &stats)) {
+            // Built without RHBLOOM_STATS
+            assert(stats.probes == 0 && stats.grows == 0);
+            rhbloom_free(rhbloom);
+            continue;
+        }
+        assert(stats.probes == 0 && stats.upgrade_ns == 0);
+        int i = 0;
+        for (; !rhbloom_upgraded(rhbloom); i++) {
+            assert(rhbloom_add(rhbloom, hash(i)));
+            assert(rhbloom_test(rhbloom, hash(i)));
+        }
+        assert(rhbloom_stats(rhbloom, &stats));
+        assert(stats.probes >= (uint64_t)(i-1)*2);
+        assert(stats.max_probe >= 1 && stats.avg_probe >= 1);
+        assert(stats.avg_probe <= stats.max_probe);
+        assert(stats.grows > 1 && stats.upgrade_ns > 0);
+        uint64_t ntests = stats.bloom_tests;
+        for (int j = 0; j < 1000; j++) {
+            rhbloom_test(rhbloom, hash(j+i));
+        }
+        assert(rhbloom_stats(rhbloom, &stats));
+        assert(stats.bloom_tests == ntests + 1000);
+        assert(stats.avg_bits >= 1 && stats.avg_bits < 7);
+        rhbloom_free(rhbloom);
+    }
+}
+
+void test_bytes(void) {
+    int n = 100000;
+    char (*strs)[32] = malloc(n*2*32);
+    const void **keys = malloc(n*2*sizeof(void*));
+    size_t *lens = malloc(n*2*sizeof(size_t));
+    bool *out = malloc(n*2);
+    assert(strs && keys && lens && out);
+    for (int i = 0; i < n*2; i++) {
+        // Varying lengths cover the short and long paths of the hash.
+        lens[i] = snprintf(strs[i], 32, "%0*d", 1+i%30, i);
+        keys[i] = strs[i];
+    }
+    for (int batch = 0; batch < 2; batch++) {
+        struct rhbloom *rhbloom = rhbloom_new(n, 0.01);
+        assert(rhbloom);
+        assert(!rhbloom_test_bytes(rhbloom, "", 0));
+        if (batch) {
+            assert(rhbloom_add_bytes_batch(rhbloom, keys, lens, n));
+            rhbloom_test_bytes_batch(rhbloom, keys, lens, n*2, out);
+        } else {
+            for (int i = 0; i < n; i++) {
+                if (!rhbloom_upgraded(rhbloom)) {
+                    assert(!rhbloom_test_bytes(rhbloom, keys[i], lens[i]));
+                }
+                assert(rhbloom_add_bytes(rhbloom, keys[i], lens[i]));
+            }
+            for (int i = 0; i < n*2; i++) {
+                out[i] = rhbloom_test_bytes(rhbloom, keys[i], lens[i]);
+            }
+        }
+        int hits = 0;
+        for (int i = 0; i < n*2; i++) {
+            assert(i >= n || out[i]);
+            hits += i >= n && out[i];
+        }
+        assert((double)hits/n < 0.015);
+        rhbloom_free(rhbloom);
+    }
+    free(out);
+    free(lens);
+    free(keys);
+    free(strs);
+}
+
+// Same layout as rhbloom_new(100000, 0.01), plain and blocked
+RHBLOOM_FIXED(fixed20, 6, 20, false)
+RHBLOOM_FIXED(fixed20b, 6, 20, true)
+
+void test_fixed(void) {
+    int n = 100000;
+    struct fixed20 *f = malloc(sizeof(struct fixed20));
+    struct fixed20b *fb = malloc(sizeof(struct fixed20b));
+    assert(f && fb);
+    for (int blocked = 0; blocked < 2; blocked++) {
+        struct rhbloom_options opts = { .blocked = blocked };
+        for (int nkeys = 100; nkeys <= n; nkeys *= 1000) {
+            // Dynamic to fixed, from the hashmap and from the bloom phase
+            struct rhbloom *rhbloom = rhbloom_new_with_options(n, 0.01, &opts);
+            assert(rhbloom);
+            for (int i = 0; i < nkeys; i++) {
+                assert(rhbloom_add(rhbloom, hash(i)));
+            }
+            assert(rhbloom_upgraded(rhbloom) == (nkeys == n));
+            size_t len = rhbloom_serialize(rhbloom, 0, 0);
+            void *buf = malloc(len);
+            assert(buf && rhbloom_serialize(rhbloom, buf, len) == len);
+            assert(blocked ? fixed20b_deserialize(fb, buf, len) : 
+                fixed20_deserialize(f, buf, len));
+            assert(!(blocked ? fixed20_deserialize(f, buf, len) : 
+                fixed20b_deserialize(fb, buf, len)));
+            for (int i = 0; i < nkeys*2; i++) {
+                bool res = blocked ? fixed20b_test(fb, hash(i)) : 
+                    fixed20_test(f, hash(i));
+                assert(i >= nkeys || res);
+                if (nkeys == n) {
+                    assert(res == rhbloom_test(rhbloom, hash(i)));
+                }
+            }
+            free(buf);
+            rhbloom_free(rhbloom);
+        }
+
+        // Fixed to dynamic
+        if (blocked) {
+            fixed20b_clear(fb);
+        } else {
+            fixed20_clear(f);
+        }
+        for (int i = 0; i < n; i++) {
+            if (blocked) {
+                fixed20b_add(fb, hash(i));
+            } else {
+                fixed20_add(f, hash(i));
+            }
+        }
+        size_t len = blocked ? fixed20b_serialize(fb, 0, 0) : 
+            fixed20_serialize(f, 0, 0);
+        void *buf = malloc(len);
+        assert(buf);
+        assert(len == (blocked ? fixed20b_serialize(fb, buf, len) : 
+            fixed20_serialize(f, buf, len)));
+        struct rhbloom *rhbloom = rhbloom_deserialize(buf, len, 0);
+        assert(rhbloom && rhbloom_upgraded(rhbloom));
+        int hits = 0;
+        for (int i = 0; i < n*2; i++) {
+            bool res = rhbloom_test(rhbloom, hash(i));
+            assert(i >= n || res);
+            hits += i >= n && res;
+        }
+        assert((double)hits/n < 0.02);
+        free(buf);
+        rhbloom_free(rhbloom);
+    }
+    free(fb);
+    free(f);
+}
+
+struct arena {
+    size_t nallocs;
+    size_t nfrees;
+    size_t size;
+};
+
+void *arena_malloc(size_t size, void *udata) {
+    struct arena *arena = udata;
+    arena->nallocs++;
+    arena->size += size;
+    return malloc(size);
+}
+
+void arena_free(void *ptr, void *udata) {
+    struct arena *arena = udata;
+    arena->nfrees++;
+    free(ptr);
+}
+
+void test_allocator(void) {
+    for (int mode = 0; mode < 4; mode++) {
+        struct arena arena = { 0 };
+        struct rhbloom_allocator allocator = { 
+            arena_malloc, arena_free, &arena,
+        };
+        struct rhbloom_options opts = { 
+            .allocator = &allocator, .incremental = mode == 1, 
+            .compressed = mode == 2, .counting = mode == 3,
+        };
+        // Many tiny filters are one allocation each
+        struct rhbloom *filters[100];
+        for (int i = 0; i < 100; i++) {
+            filters[i] = rhbloom_new_with_options(1000, 0.01, &opts);
+            assert(filters[i]);
+            for (int j = 0; j < 8; j++) {
+                assert(rhbloom_add(filters[i], hash(i*8+j)));
+            }
+        }
+        assert(arena.nallocs == 100 && arena.nfrees == 0);
+        for (int i = 0; i < 100; i++) {
+            for (int j = 0; j < 8; j++) {
+                assert(rhbloom_test(filters[i], hash(i*8+j)));
+            }
+            assert(!rhbloom_test(filters[i], hash(1000000+i)));
+        }
+
+        // Tiny tables round trip into the inline buckets
+        size_t len = rhbloom_serialize(filters[0], 0, 0);
+        void *buf = malloc(len);
+        assert(buf && rhbloom_serialize(filters[0], buf, len) == len);
+        struct rhbloom *copy = rhbloom_deserialize(buf, len, &opts);
+        assert(copy);
+        assert(arena.nallocs == 101);
+        for (int j = 0; j < 8; j++) {
+            assert(rhbloom_test(copy, hash(j)));
+        }
+        assert(rhbloom_intersect(copy, filters[0]));
+        assert(rhbloom_union(copy, filters[1]));
+        assert(rhbloom_test(copy, hash(0)) && rhbloom_test(copy, hash(8)));
+        rhbloom_free(copy);
+        free(buf);
+
+        // Growing out of the inline buckets and upgrading
+        for (int j = 8; j < 2000; j++) {
+            assert(rhbloom_add(filters[0], hash(j)));
+        }
+        assert(rhbloom_upgraded(filters[0]));
+        for (int j = 0; j < 2000; j++) {
+            assert(rhbloom_test(filters[0], hash(j)));
+        }
+        for (int i = 0; i < 100; i++) {
+            rhbloom_free(filters[i]);
+        }
+        assert(arena.nallocs == arena.nfrees);
+    }
+
+    // The plain allocator functions still work, and an incomplete
+    // allocator is rejected.
+    struct rhbloom_allocator bad = { arena_malloc, 0, 0 };
+    struct rhbloom_options opts = { .allocator = &bad };
+    assert(!rhbloom_new_with_options(1000, 0.01, &opts));
+    nallocs = 0;
+    struct rhbloom *rhbloom = rhbloom_new_with_allocator(1000, 0.01, 
+        counting_malloc, free);
+    assert(rhbloom && rhbloom_add(rhbloom, 1) && nallocs == 1);
+    rhbloom_free(rhbloom);
+}
+
+void test_pages(void) {
+    // Huge pages and numa policies are best effort, so every combination
+    // must work whether or not the system has them.
+    int n = 1000000;
+    for (int pages = 0; pages < 4; pages++) {
+        for (int numa = 0; numa < 3; numa++) {
+            struct rhbloom_options opts = { 
+                .pages = pages, .numa = numa, .numa_node = 0,
+                .blocked = numa == 1,
+            };
+            struct rhbloom *a = rhbloom_new_with_options(n, 0.01, &opts);
+            struct rhbloom *b = rhbloom_new_with_options(n, 0.01, &opts);
+            assert(a && b);
+            for (int i = 0; i < 100000; i++) {
+                assert(rhbloom_add(a, hash(i)));
+                assert(rhbloom_add(b, hash(i+50000)));
+            }
+            assert(rhbloom_upgraded(a) && rhbloom_upgraded(b));
+            assert(rhbloom_union(a, b));
+            for (int i = 0; i < 150000; i++) {
+                assert(rhbloom_test(a, hash(i)));
+            }
+            assert(rhbloom_intersect(b, a));
+            for (int i = 50000; i < 150000; i++) {
+                assert(rhbloom_test(b, hash(i)));
+            }
+            rhbloom_clear(b);
+            assert(!rhbloom_test(b, hash(60000)));
+            rhbloom_free(a);
+            rhbloom_free(b);
+        }
+    }
+
+    // Every layer of a scalable filter uses the same pages
+    struct rhbloom_options opts = { 
+        .pages = RHBLOOM_PAGES_HUGE, .numa = RHBLOOM_NUMA_INTERLEAVE,
+        .scalable = true,
+    };
+    struct rhbloom *rhbloom = rhbloom_new_with_options(10000, 0.01, &opts);
+    assert(rhbloom);
+    for (int i = 0; i < 100000; i++) {
+        assert(rhbloom_add(rhbloom, hash(i)));
+    }
+    for (int i = 0; i < 100000; i++) {
+        assert(rhbloom_test(rhbloom, hash(i)));
+    }
+    rhbloom_free(rhbloom);
+}
+
+struct sharded_ctx {
+    struct rhbloom_sharded *sharded;
+    size_t index;
+    int nkeys;
+};
+
+// Each writer owns a shard and adds only the keys that route to it.
+void *sharded_worker(void *arg) {
+    struct sharded_ctx *ctx = arg;
+    struct rhbloom *shard = rhbloom_sharded_shard(ctx->sharded, ctx->index);
+    for (int i = 0; i < ctx->nkeys; i++) {
+        if (rhbloom_sharded_index(ctx->sharded, hash(i)) == ctx->index) {
+            assert(rhbloom_add(shard, hash(i)));
+        }
+    }
+    return 0;
+}
+
+void test_sharded(void) {
+    size_t nshards[] = { 1, 3, 16 };
+    for (int t = 0; t < 3; t++) {
+        int n = 100000;
+        struct rhbloom_options opts = { .blocked = t == 1 };
+        struct rhbloom_sharded *sharded = rhbloom_sharded_new(n, 0.01, 
+            nshards[t], &opts);
+        assert(sharded);
+        size_t count = rhbloom_sharded_nshards(sharded);
+        assert(count == (nshards[t] == 3 ? 4 : nshards[t]));
+        assert(!rhbloom_sharded_shard(sharded, count));
+        size_t memsize = rhbloom_sharded_memsize(sharded);
+        for (int i = 0; i < n; i++) {
+            assert(rhbloom_sharded_add(sharded, hash(i)));
+            assert(rhbloom_sharded_index(sharded, hash(i)) < count);
+        }
+        assert(rhbloom_sharded_memsize(sharded) > memsize);
+        // Keys spread over all shards, and each shard upgrades on its own.
+        for (size_t i = 0; i < count; i++) {
+            struct rhbloom *shard = rhbloom_sharded_shard(sharded, i);
+            size_t est = rhbloom_count_estimate(shard);
+            assert(est > (size_t)n/count*9/10 && est < (size_t)n/count*11/10);
+            assert(rhbloom_upgraded(shard));
+        }
+        int misses = 0;
+        for (int i = 0; i < n; i++) {
+            assert(rhbloom_sharded_test(sharded, hash(i)));
+            misses += rhbloom_sharded_test(sharded, hash(n+i));
+            // The same hash as a direct add to the shard
+            struct rhbloom *shard = rhbloom_sharded_shard(sharded, 
+                rhbloom_sharded_index(sharded, hash(i)));
+            assert(rhbloom_test(shard, hash(i)));
+        }
+        assert(misses < n/50);
+        rhbloom_sharded_clear(sharded);
+        for (int i = 0; i < n; i++) {
+            assert(!rhbloom_sharded_test(sharded, hash(i)));
+        }
+        rhbloom_sharded_free(sharded);
+    }
+
+    // One writer thread per shard, with no shared filter
+    struct rhbloom_sharded *sharded = rhbloom_sharded_new(400000, 0.01, 4, 0);
+    assert(sharded);
+    pthread_t threads[4];
+    struct sharded_ctx ctxs[4];
+    for (int i = 0; i < 4; i++) {
+        ctxs[i] = (struct sharded_ctx){ sharded, i, 400000 };
+        assert(!pthread_create(&threads[i], 0, sharded_worker, &ctxs[i]));
+    }
+    for (int i = 0; i < 4; i++) {
+        assert(!pthread_join(threads[i], 0));
+    }
+    for (int i = 0; i < 400000; i++) {
+        assert(rhbloom_sharded_test(sharded, hash(i)));
+    }
+    rhbloom_sharded_free(sharded);
+}
+
+void test_reset(void) {
+    for (int mode = 0; mode < 7; mode++) {
+        struct rhbloom_options opts = { 
+            .blocked = mode == 1, .counting = mode == 2, 
+            .compressed = mode == 3, .incremental = mode == 4,
+            .scalable = mode == 5, .concurrent = mode == 6,
+        };
+        int n = 100000;
+        struct rhbloom *rhbloom = rhbloom_new_with_options(n, 0.01, &opts);
+        assert(rhbloom);
+        size_t memsize = rhbloom_memsize(rhbloom);
+        for (int round = 0; round < 2; round++) {
+            // Scalable filters grow a few layers past n.
+            int nkeys = mode == 5 ? n*4 : n;
+            for (int i = 0; i < nkeys; i++) {
+                assert(rhbloom_add(rhbloom, hash(round*nkeys+i)));
+            }
+            assert(rhbloom_upgraded(rhbloom));
+            for (int i = 0; i < nkeys; i++) {
+                assert(rhbloom_test(rhbloom, hash(round*nkeys+i)));
+            }
+            assert(rhbloom_memsize(rhbloom) > memsize);
+            rhbloom_reset(rhbloom);
+            assert(!rhbloom_upgraded(rhbloom));
+            assert(rhbloom_memsize(rhbloom) == memsize);
+            assert(rhbloom_count_estimate(rhbloom) == 0);
+            for (int i = 0; i < nkeys; i++) {
+                assert(!rhbloom_test(rhbloom, hash(round*nkeys+i)));
+            }
+        }
+        // Back to the hashmap phase, so small filters are exact again
+        for (int i = 0; i < 1000; i++) {
+            assert(rhbloom_add(rhbloom, hash(i)));
+        }
+        assert(!rhbloom_upgraded(rhbloom));
+        for (int i = 0; i < 1000; i++) {
+            // Narrow slots only keep a fingerprint.
+            assert(rhbloom_test_ex(rhbloom, hash(i)) == 
+                (mode == 3 ? RHBLOOM_PROBABLE : RHBLOOM_PRESENT));
+            assert(!rhbloom_test(rhbloom, hash(1000+i)));
+        }
+        rhbloom_free(rhbloom);
+    }
+
+    // Mapped bits are cleared by giving their pages back, and must read as
+    // zero afterwards, like allocated bits.
+    for (int pages = 0; pages < 2; pages++) {
+        struct rhbloom_options opts = { .pages = pages };
+        struct rhbloom *rhbloom = rhbloom_new_with_options(1000000, 0.01, 
+            &opts);
+        assert(rhbloom);
+        for (int round = 0; round < 2; round++) {
+            for (int i = 0; i < 1000000; i++) {
+                assert(rhbloom_add(rhbloom, hash(i)));
+            }
+            assert(rhbloom_fpr_estimate(rhbloom) > 0.001);
+            rhbloom_clear(rhbloom);
+            assert(rhbloom_upgraded(rhbloom));
+            assert(rhbloom_count_estimate(rhbloom) == 0);
+            for (int i = 0; i < 1000000; i++) {
+                assert(!rhbloom_test(rhbloom, hash(i)));
+            }
+        }
+        rhbloom_free(rhbloom);
+    }
+}
+
+void test_window(void) {
+    for (int mode = 0; mode < 3; mode++) {
+        struct rhbloom_options opts = { 
+            .blocked = mode == 1, .compressed = mode == 2,
+        };
+        int n = 10000;
+        struct rhbloom_window *window = rhbloom_window_new(n, 0.01, 4, &opts);
+        assert(window);
+        assert(rhbloom_window_ngens(window) == 4);
+        assert(!rhbloom_window_gen(window, 4));
+        size_t memsize = rhbloom_window_memsize(window);
+        uint64_t keys[1000];
+        bool out[1000];
+        for (int g = 0; g < 10; g++) {
+            if (g > 0) {
+                rhbloom_window_rotate(window);
+                assert(!rhbloom_upgraded(rhbloom_window_gen(window, 0)));
+            }
+            for (int i = 0; i < n; i++) {
+                assert(rhbloom_window_add(window, hash(g*n+i)));
+            }
+            assert(rhbloom_upgraded(rhbloom_window_gen(window, 0)));
+            // The last four generations are in the window, older ones are
+            // gone.
+            for (int h = 0; h <= g; h++) {
+                bool in = g - h < 4;
+                int misses = 0;
+                for (int i = 0; i < n; i++) {
+                    bool found = rhbloom_window_test(window, hash(h*n+i));
+                    assert(found || !in);
+                    misses += found && !in;
+                }
+                assert(misses < n/50);
+                for (int i = 0; i < 1000; i++) {
+                    keys[i] = hash(h*n+i);
+                }
+                rhbloom_window_test_batch(window, keys, 1000, out);
+                for (int i = 0; i < 1000; i++) {
+                    assert(out[i] == rhbloom_window_test(window, keys[i]));
+                }
+            }
+        }
+        // A quiet window takes next to no memory.
+        for (int g = 0; g < 4; g++) {
+            rhbloom_window_rotate(window);
+        }
+        assert(rhbloom_window_memsize(window) == memsize);
+        for (int i = 0; i < 1000; i++) {
+            keys[i] = hash(9*n+i);
+        }
+        assert(rhbloom_window_add_batch(window, keys, 1000));
+        rhbloom_window_test_batch(window, keys, 1000, out);
+        for (int i = 0; i < 1000; i++) {
+            assert(out[i]);
+        }
+        rhbloom_window_clear(window);
+        assert(rhbloom_window_memsize(window) == memsize);
+        assert(!rhbloom_window_test(window, keys[0]));
+        rhbloom_window_free(window);
+    }
+}
+
+// Number of keys added when the filter upgraded.
+int keys_at_upgrade(struct rhbloom *rhbloom) {
+    int i = 0;
+    while (!rhbloom_upgraded(rhbloom)) {
+        assert(rhbloom_add(rhbloom, hash(i)));
+        i++;
+    }
+    return i - 1;
+}
+
+void test_policy(void) {
+    struct rhbloom_options bad[] = {
+        { .load_factor = 0.99 }, { .load_factor = -1 }, 
+        { .upgrade_ratio = -1 }, { .compressed = true, .upgrade_ratio = 2 },
+    };
+    for (int i = 0; i < 4; i++) {
+        assert(!rhbloom_new_with_options(100000, 0.01, &bad[i]));
+    }
+
+    int n = 1000000;
+    struct rhbloom *rhbloom = rhbloom_new(n, 0.01);
+    assert(rhbloom);
+    int base = keys_at_upgrade(rhbloom);
+    rhbloom_free(rhbloom);
+
+    // A higher load factor holds more keys in the same tables.
+    struct rhbloom_options opts = { .load_factor = 0.85 };
+    rhbloom = rhbloom_new_with_options(n, 0.01, &opts);
+    assert(rhbloom);
+    assert(keys_at_upgrade(rhbloom) >= base*16/10);
+    rhbloom_free(rhbloom);
+    struct rhbloom *half = rhbloom_new(n, 0.01);
+    rhbloom = rhbloom_new_with_options(n, 0.01, &opts);
+    assert(half && rhbloom);
+    for (int i = 0; i < 600; i++) {
+        assert(rhbloom_add(half, hash(i)) && rhbloom_add(rhbloom, hash(i)));
+    }
+    assert(rhbloom_memsize(rhbloom) < rhbloom_memsize(half));
+    rhbloom_free(half);
+    rhbloom_free(rhbloom);
+
+    // The upgrade threshold moves the upgrade in powers of two.
+    opts = (struct rhbloom_options){ .upgrade_ratio = 0.25 };
+    rhbloom = rhbloom_new_with_options(n, 0.01, &opts);
+    assert(rhbloom);
+    assert(keys_at_upgrade(rhbloom) == base/4);
+    rhbloom_free(rhbloom);
+    opts = (struct rhbloom_options){ .upgrade_ratio = 4 };
+    rhbloom = rhbloom_new_with_options(n, 0.01, &opts);
+    assert(rhbloom);
+    assert(keys_at_upgrade(rhbloom) == base*4);
+    rhbloom_free(rhbloom);
+
+    // The table never grows past the budget.
+    opts = (struct rhbloom_options){ .memory_budget = 65536 };
+    rhbloom = rhbloom_new_with_options(n, 0.01, &opts);
+    assert(rhbloom);
+    assert(keys_at_upgrade(rhbloom) == 4096);
+    rhbloom_free(rhbloom);
+    opts = (struct rhbloom_options){ .memory_budget = 64 };
+    rhbloom = rhbloom_new_with_options(n, 0.01, &opts);
+    assert(rhbloom && rhbloom_add(rhbloom, 1) && rhbloom_upgraded(rhbloom));
+    rhbloom_free(rhbloom);
+
+    // Every mode keeps its keys at a high load, and high load tables
+    // round trip.
+    for (int mode = 0; mode < 5; mode++) {
+        opts = (struct rhbloom_options){ 
+            .load_factor = 0.95, .blocked = mode == 1,
+            .incremental = mode == 2, .compressed = mode == 3, 
+            .concurrent = mode == 4,
+        };
+        rhbloom = rhbloom_new_with_options(n, 0.01, &opts);
+        assert(rhbloom);
+        for (int i = 0; i < 3000; i++) {
+            assert(rhbloom_add(rhbloom, hash(i)));
+        }
+        assert(!rhbloom_upgraded(rhbloom));
+        if (mode != 4) {
+            // The copy isn't concurrent, which changes its memsize.
+            size_t size;
+            free(serialize_roundtrip(rhbloom, 3000, &size));
+        }
+        struct rhbloom *built = rhbloom_build_with_options(
+            (uint64_t[]){ hash(0), hash(1) }, 2, 0.01, 1, &opts);
+        assert(built && rhbloom_test(built, hash(1)));
+        rhbloom_free(built);
+        for (int i = 3000; i < 200000; i++) {
+            assert(rhbloom_add(rhbloom, hash(i)));
+        }
+        for (int i = 0; i < 200000; i++) {
+            assert(rhbloom_test(rhbloom, hash(i)));
+        }
+        rhbloom_free(rhbloom);
+    }
+}
+
+void test_lookup(void) {
+    for (int mode = 0; mode < 3; mode++) {
+        struct rhbloom_options opts = { 
+            .blocked = mode == 1, .concurrent = mode == 2,
+        };
+        int n = 100000;
+        struct rhbloom *rhbloom = rhbloom_new_with_options(n, 0.01, &opts);
+        assert(rhbloom);
+        // Keep a window of lookups in flight while the filter grows and
+        // upgrades underneath them.
+        struct rhbloom_lookup lookups[16];
+        for (int i = 0; i < n*2; i++) {
+            if (i < n) {
+                assert(rhbloom_add(rhbloom, hash(i)));
+            }
+            if (i >= 16) {
+                int j = i - 16;
+                bool found = rhbloom_lookup_finish(rhbloom, lookups[j%16]);
+                assert(found == rhbloom_test(rhbloom, hash(j)));
+                assert(found || j >= n);
+            }
+            lookups[i%16] = rhbloom_lookup_begin(rhbloom, hash(i));
+        }
+        assert(rhbloom_upgraded(rhbloom));
+        rhbloom_free(rhbloom);
+    }
+    struct rhbloom *rhbloom = rhbloom_new(1000, 0.01);
+    assert(rhbloom && rhbloom_add_bytes(rhbloom, "hello", 5));
+    assert(rhbloom_lookup_finish(rhbloom, 
+        rhbloom_lookup_begin_bytes(rhbloom, "hello", 5)));
+    assert(!rhbloom_lookup_finish(rhbloom, 
+        rhbloom_lookup_begin_bytes(rhbloom, "world", 5)));
+    rhbloom_free(rhbloom);
+}
+
+void test_branchless(void) {
+    for (int mode = 0; mode < 3; mode++) {
+        struct rhbloom_options opts = { 
+            .blocked = mode == 1, .scalable = mode == 2,
+        };
+        struct rhbloom_options bopts = opts;
+        bopts.branchless = true;
+        int n = 100000;
+        struct rhbloom *a = rhbloom_new_with_options(n, 0.01, &opts);
+        struct rhbloom *b = rhbloom_new_with_options(n, 0.01, &bopts);
+        assert(a && b);
+        int nkeys = mode == 2 ? n*4 : n;
+        for (int i = 0; i < nkeys; i++) {
+            assert(rhbloom_add(a, hash(i)) && rhbloom_add(b, hash(i)));
+        }
+        bool out[1000];
+        uint64_t keys[1000];
+        for (int i = 0; i < nkeys*2; i++) {
+            assert(rhbloom_test(a, hash(i)) == rhbloom_test(b, hash(i)));
+        }
+        for (int i = 0; i < 1000; i++) {
+            keys[i] = hash(nkeys-500+i);
+        }
+        rhbloom_test_batch(b, keys, 1000, out);
+        for (int i = 0; i < 1000; i++) {
+            assert(out[i] == rhbloom_test(a, keys[i]));
+        }
+        rhbloom_free(a);
+        rhbloom_free(b);
+    }
+}
+
+void test_scan(void) {
+    // Full tables have long runs of buckets, many of which wrap around the
+    // end of the table. Every answer must be exact while in the hashmap.
+    double loads[] = { 0.5, 0.95 };
+    for (int l = 0; l < 2; l++) {
+        for (int round = 0; round < 20; round++) {
+            struct rhbloom_options opts = { .load_factor = loads[l] };
+            struct rhbloom *rhbloom = rhbloom_new_with_options(1000000, 0.01,
+                &opts);
+            assert(rhbloom);
+            int n = 2000;
+            int start = round*n*2;
+            for (int i = 0; i < n; i++) {
+                assert(rhbloom_add(rhbloom, hash(start+i)));
+                assert(rhbloom_test_ex(rhbloom, hash(start+i)) == 
+                    RHBLOOM_PRESENT);
+            }
+            for (int i = 0; i < n; i++) {
+                assert(rhbloom_test(rhbloom, hash(start+i)));
+                assert(!rhbloom_test(rhbloom, hash(start+n+i)));
+            }
+            for (int i = 0; i < n; i += 2) {
+                assert(rhbloom_delete(rhbloom, hash(start+i)));
+                assert(!rhbloom_delete(rhbloom, hash(start+i)));
+            }
+            for (int i = 0; i < n; i++) {
+                assert(rhbloom_test(rhbloom, hash(start+i)) == (i % 2 == 1));
+            }
+            assert(!rhbloom_upgraded(rhbloom));
+            rhbloom_free(rhbloom);
+        }
+    }
+}
+
+// Ship the changes of the primary since its last snapshot to the replica.
+// Returns the size of the delta.
+size_t ship_delta(struct rhbloom *primary, struct rhbloom *replica) {
+    uint64_t since = rhbloom_snapshot(replica);
+    size_t len = rhbloom_delta(primary, since, 0, 0);
+    assert(len);
+    uint8_t *data = malloc(len);
+    assert(data);
+    assert(rhbloom_delta(primary, since, data, len) == len);
+    // A delta is not a filter
+    assert(!rhbloom_deserialize(data, len, 0));
+    // Corrupted data is rejected
+    data[len-1] ^= 0x10;
+    assert(!rhbloom_apply_delta(replica, data, len));
+    data[len-1] ^= 0x10;
+    assert(rhbloom_apply_delta(replica, data, len));
+    assert(rhbloom_snapshot(replica) == rhbloom_snapshot(primary));
+    // A partial delta applies only once, to the snapshot it was written for,
+    // and a full delta to any.
+    uint64_t from = 0;
+    for (int i = 0; i < 8; i++) {
+        from |= (uint64_t)data[64+i] << (i*8);
+    }
+    assert(from == 0 || from == since);
+    assert(rhbloom_apply_delta(replica, data, len) == (from == 0));
+    free(data);
+    return len;
+}
+
+void test_delta(void) {
+    for (int mode = 0; mode < 5; mode++) {
+        struct rhbloom_options opts = { 
+            .blocked = mode == 1,
+            .counting = mode == 2,
+            .compressed = mode == 3,
+            .incremental = mode == 4,
+        };
+        struct rhbloom *replica = rhbloom_new_with_options(100000, 0.01, 
+            &opts);
+        opts.tracking = true;
+        struct rhbloom *primary = rhbloom_new_with_options(100000, 0.01, 
+            &opts);
+        assert(primary && replica);
+        size_t full = rhbloom_serialize(primary, 0, 0);
+        assert(ship_delta(primary, replica) == full + 16);
+        int n = 0;
+        while (n < 200000) {
+            // Grow by a few keys, then by many
+            int more = n < 1000 || (n >= 150000 && n < 150100) ? 2 : 997;
+            bool upgraded = rhbloom_upgraded(primary);
+            int start = n;
+            for (int i = 0; i < more; i++) {
+                assert(rhbloom_add(primary, hash(n++)));
+            }
+            full = rhbloom_serialize(primary, 0, 0);
+            size_t len = ship_delta(primary, replica);
+            if (!upgraded && !rhbloom_upgraded(primary)) {
+                // The keys that were added
+                assert(len == 64 + 16 + (size_t)more * 8);
+            } else if (upgraded && more == 2) {
+                // Only the changed blocks
+                assert(len < full);
+            }
+            for (int i = start; i < n; i++) {
+                assert(rhbloom_test(replica, hash(i)));
+            }
+            if (rhbloom_upgraded(primary)) {
+                // The bits are the same
+                assert(rhbloom_upgraded(replica));
+                size_t rlen = rhbloom_serialize(replica, 0, 0);
+                assert(rlen == full);
+                uint8_t *a = malloc(full);
+                uint8_t *b = malloc(full);
+                assert(a && b);
+                rhbloom_serialize(primary, a, full);
+                rhbloom_serialize(replica, b, full);
+                assert(memcmp(a, b, full) == 0);
+                free(a);
+                free(b);
+            }
+        }
+        // A fresh replica, or one that missed a delta, gets a full copy
+        struct rhbloom *fresh = rhbloom_new_with_options(100000, 0.01, 0);
+        opts.tracking = false;
+        struct rhbloom *late = rhbloom_new_with_options(100000, 0.01, &opts);
+        assert(fresh && late);
+        size_t len = rhbloom_delta(primary, 0, 0, 0);
+        uint8_t *data = malloc(len);
+        assert(data);
+        assert(rhbloom_delta(primary, 0, data, len) == len);
+        assert(rhbloom_apply_delta(late, data, len));
+        // Another layout is rejected, incremental growth is not layout
+        assert(mode == 0 || mode == 4 || 
+            !rhbloom_apply_delta(fresh, data, len));
+        assert(!rhbloom_apply_delta(replica, data, 63));
+        free(data);
+        assert(ship_delta(primary, late) < len);
+        assert(ship_delta(primary, replica) == len);
+        for (int i = 0; i < n; i++) {
+            assert(rhbloom_test(late, hash(i)));
+            assert(rhbloom_test(replica, hash(i)));
+        }
+        rhbloom_free(fresh);
+        rhbloom_free(late);
+        rhbloom_free(replica);
+        rhbloom_free(primary);
+    }
+
+    // Changes that the log can't carry ship the whole filter
+    struct rhbloom_options opts = { .tracking = true };
+    struct rhbloom *primary = rhbloom_new_with_options(100000, 0.01, &opts);
+    struct rhbloom *replica = rhbloom_new(100000, 0.01);
+    assert(primary && replica);
+    ship_delta(primary, replica);
+    for (int i = 0; i < 1000; i++) {
+        assert(rhbloom_add(primary, hash(i)));
+    }
+    assert(ship_delta(primary, replica) == 64 + 16 + 1000 * 8);
+    assert(rhbloom_delete(primary, hash(0)));
+    size_t full = rhbloom_serialize(primary, 0, 0);
+    assert(ship_delta(primary, replica) == full + 16);
+    assert(!rhbloom_test(replica, hash(0)));
+    assert(rhbloom_test(replica, hash(1)));
+    rhbloom_clear(primary);
+    assert(ship_delta(primary, replica) == full + 16);
+    assert(!rhbloom_test(replica, hash(1)));
+    rhbloom_free(replica);
+    rhbloom_free(primary);
+
+    // Deltas need tracking, which needs a filter that is not concurrent or
+    // scalable.
+    primary = rhbloom_new(1000, 0.01);
+    assert(primary);
+    assert(rhbloom_delta(primary, 0, 0, 0) == 0);
+    rhbloom_free(primary);
+    opts.concurrent = true;
+    assert(!rhbloom_new_with_options(1000, 0.01, &opts));
+    opts.concurrent = false;
+    opts.scalable = true;
+    assert(!rhbloom_new_with_options(1000, 0.01, &opts));
+}
+
 void test(void) {
     for (int n = 0; n < 100000; n += 1000) {
         for (double p = 0.01; p < 0.70; p += 0.05) {
@@ -125,6 +1794,33 @@ void test(void) {
             rhbloom_free(rhbloom);
         }
     }
+    test_blocked();
+    test_batch();
+    test_concurrent();
+    test_serialize();
+    test_view();
+    test_merge();
+    test_build();
+    test_reserve();
+    test_incremental();
+    test_scalable();
+    test_delete();
+    test_compressed();
+    test_ex();
+    test_estimate();
+    test_stats();
+    test_bytes();
+    test_fixed();
+    test_allocator();
+    test_pages();
+    test_sharded();
+    test_reset();
+    test_window();
+    test_policy();
+    test_lookup();
+    test_branchless();
+    test_scan();
+    test_delta();
     printf("PASSED\n");
 }
 
@@ -195,11 +1891,327 @@ void bench(int argc, char *argv[]) {
     free(hashes);
 }
 
+// Benchmark suite
+//
+// Every result is printed as one JSON object per line, so runs can be
+// stored and compared over time. Keys are 64-bit and generated on the fly,
+// allowing sizes past the memory of a key array.
+
+// Stop the suite when a call fails. Unlike assert, this stays in a build
+// with -DNDEBUG, which is the build to benchmark.
+void suite_check(bool ok, const char *what) {
+    if (!ok) {
+        fprintf(stderr, "suite: %s failed\n", what);
+        exit(1);
+    }
+}
+
+uint64_t suite_key(uint64_t i) {
+    // splitmix64
+    uint64_t z = i + UINT64_C(0x9e3779b97f4a7c15);
+    z = (z ^ (z >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+    z = (z ^ (z >> 27)) * UINT64_C(0x94d049bb133111eb);
+    return z ^ (z >> 31);
+}
+
+uint64_t suite_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Log-linear latency histogram, 8 buckets per power of two, so every add
+// is recorded at any size without storing the samples.
+#define SUITE_HIST 512
+
+struct suite_hist {
+    uint64_t counts[SUITE_HIST];
+    uint64_t n;
+    uint64_t max;
+};
+
+void suite_hist_add(struct suite_hist *h, uint64_t ns) {
+    int i = ns;
+    if (ns >= 8) {
+        int lg = 63 - __builtin_clzll(ns);
+        i = lg * 8 + (int)((ns >> (lg - 3)) & 7) - 16;
+    }
+    h->counts[i < SUITE_HIST ? i : SUITE_HIST-1]++;
+    h->n++;
+    h->max = ns > h->max ? ns : h->max;
+}
+
+// Lower bound of the bucket holding the q quantile.
+uint64_t suite_hist_quantile(struct suite_hist *h, double q) {
+    uint64_t rank = (uint64_t)(q * (h->n - 1));
+    uint64_t seen = 0;
+    for (int i = 0; i < SUITE_HIST; i++) {
+        seen += h->counts[i];
+        if (seen > rank) {
+            if (i < 8) {
+                return i;
+            }
+            int lg = (i + 16) / 8;
+            return ((uint64_t)8 | ((i + 16) % 8)) << (lg - 3);
+        }
+    }
+    return h->max;
+}
+
+const char *suite_layout_name(int layout) {
+    return layout == 0 ? "classic" : layout == 1 ? "blocked" : 
+        layout == 2 ? "batch" : "pipelined";
+}
+
+void suite_print(const char *bench, size_t n, double p, const char *layout,
+    int threads, size_t ops, uint64_t elapsed_ns)
+{
+    printf("{\"bench\":\"%s\",\"n\":%zu,\"p\":%g,\"layout\":\"%s\","
+        "\"threads\":%d,\"ops\":%zu,\"ns_per_op\":%.2f,"
+        "\"ops_per_sec\":%.0f}\n", bench, n, p, layout, threads, ops,
+        (double)elapsed_ns / ops, ops / ((double)elapsed_ns / 1e9));
+}
+
+// Number of lookups in flight for the pipelined layout.
+#define SUITE_DEPTH 8
+
+// Number of times that a small size is repeated, for at least a million
+// operations per result.
+#define SUITE_MINOPS 1048576
+
+// Add, test present, and test absent keys for one size, p, and layout. The
+// batch layout is the classic layout driven through the batch functions.
+void suite_paths(size_t n, double p, int layout) {
+    struct rhbloom_options opts = { .blocked = layout == 1 };
+    struct rhbloom *rhbloom = 0;
+    const char *name = suite_layout_name(layout);
+    size_t reps = n < SUITE_MINOPS ? SUITE_MINOPS / n : 1;
+    uint64_t keys[256];
+    bool out[256];
+    uint64_t elapsed = 0;
+    size_t fails = 0;
+    for (size_t r = 0; r < reps; r++) {
+        // Each repeat fills a new filter, which is created and freed off the
+        // clock.
+        if (rhbloom) {
+            rhbloom_free(rhbloom);
+        }
+        rhbloom = rhbloom_new_with_options(n, p, &opts);
+        suite_check(rhbloom, "rhbloom_new");
+        uint64_t start = suite_now_ns();
+        for (size_t i = 0; i < n; ) {
+            if (layout == 2) {
+                size_t nb = n - i < 256 ? n - i : 256;
+                for (size_t j = 0; j < nb; j++) {
+                    keys[j] = suite_key(i + j);
+                }
+                fails += !rhbloom_add_batch(rhbloom, keys, nb);
+                i += nb;
+            } else {
+                fails += !rhbloom_add(rhbloom, suite_key(i));
+                i++;
+            }
+        }
+        elapsed += suite_now_ns() - start;
+    }
+    suite_check(!fails, "rhbloom_add");
+    suite_print("add", n, p, name, 1, n*reps, elapsed);
+    for (int absent = 0; absent < 2; absent++) {
+        size_t hits = 0;
+        uint64_t start = suite_now_ns();
+        for (size_t i = 0; i < n*reps; ) {
+            uint64_t base = absent ? n + i : i % n;
+            if (layout == 2) {
+                size_t nb = n - i % n < 256 ? n - i % n : 256;
+                for (size_t j = 0; j < nb; j++) {
+                    keys[j] = suite_key(base + j);
+                }
+                rhbloom_test_batch(rhbloom, keys, nb, out);
+                for (size_t j = 0; j < nb; j++) {
+                    hits += out[j];
+                }
+                i += nb;
+            } else if (layout == 3) {
+                struct rhbloom_lookup lookups[SUITE_DEPTH];
+                size_t nb = n - i % n < SUITE_DEPTH ? n - i % n : SUITE_DEPTH;
+                for (size_t j = 0; j < nb; j++) {
+                    lookups[j] = rhbloom_lookup_begin(rhbloom, 
+                        suite_key(base + j));
+                }
+                for (size_t j = 0; j < nb; j++) {
+                    hits += rhbloom_lookup_finish(rhbloom, lookups[j]);
+                }
+                i += nb;
+            } else {
+                hits += rhbloom_test(rhbloom, suite_key(base));
+                i++;
+            }
+        }
+        elapsed = suite_now_ns() - start;
+        suite_print(absent ? "test_no" : "test_yes", n, p, name, 1, n*reps, 
+            elapsed);
+        if (absent) {
+            printf("{\"bench\":\"fpr\",\"n\":%zu,\"p\":%g,"
+                "\"layout\":\"%s\",\"fpr\":%.6f,\"bytes\":%zu}\n", n, p, 
+                name, (double)hits / (n*reps), rhbloom_memsize(rhbloom));
+        } else {
+            suite_check(hits == n*reps, "rhbloom_test");
+        }
+    }
+    rhbloom_free(rhbloom);
+}
+
+// Tests of the early exit and branchless paths, on traffic where each key is
+// absent with the given odds, in random order. Shows where the two break
+// even.
+void suite_branchless(size_t n, double p) {
+    struct rhbloom *filters[2];
+    for (int b = 0; b < 2; b++) {
+        struct rhbloom_options opts = { .branchless = b == 1 };
+        filters[b] = rhbloom_new_with_options(n, p, &opts);
+        suite_check(filters[b], "rhbloom_new");
+        for (size_t i = 0; i < n; i++) {
+            suite_check(rhbloom_add(filters[b], suite_key(i)), "rhbloom_add");
+        }
+    }
+    size_t ops = n < SUITE_MINOPS ? SUITE_MINOPS : n;
+    for (int miss = 0; miss <= 100; miss += 25) {
+        for (int b = 0; b < 2; b++) {
+            size_t hits = 0;
+            uint64_t start = suite_now_ns();
+            for (size_t i = 0; i < ops; i++) {
+                bool absent = suite_key(i ^ 0x5bd1e995) % 100 < (uint64_t)miss;
+                hits += rhbloom_test(filters[b], 
+                    suite_key(absent ? n + i : i % n));
+            }
+            uint64_t elapsed = suite_now_ns() - start;
+            printf("{\"bench\":\"test_mix\",\"n\":%zu,\"p\":%g,"
+                "\"layout\":\"%s\",\"miss\":%d,\"ops\":%zu,"
+                "\"ns_per_op\":%.2f,\"hits\":%zu}\n", n, p, 
+                b ? "branchless" : "early_exit", miss, ops, 
+                (double)elapsed / ops, hits);
+        }
+    }
+    rhbloom_free(filters[0]);
+    rhbloom_free(filters[1]);
+}
+
+// Latency of every add, with the memory at each power of two of keys and
+// right after the upgrade.
+void suite_latency(size_t n, double p) {
+    struct rhbloom *rhbloom = rhbloom_new(n, p);
+    struct suite_hist *h = calloc(1, sizeof(struct suite_hist));
+    suite_check(rhbloom && h, "rhbloom_new");
+    bool upgraded = false;
+    size_t fails = 0;
+    for (size_t i = 0; i < n; i++) {
+        uint64_t start = suite_now_ns();
+        fails += !rhbloom_add(rhbloom, suite_key(i));
+        suite_hist_add(h, suite_now_ns() - start);
+        bool upgrade = !upgraded && rhbloom_upgraded(rhbloom);
+        upgraded = upgraded || upgrade;
+        if (upgrade || ((i+1) & i) == 0 || i == n-1) {
+            printf("{\"bench\":\"memory\",\"n\":%zu,\"p\":%g,"
+                "\"keys\":%zu,\"bytes\":%zu,\"upgraded\":%s}\n", n, p, i+1, 
+                rhbloom_memsize(rhbloom), upgraded ? "true" : "false");
+        }
+    }
+    suite_check(!fails, "rhbloom_add");
+    printf("{\"bench\":\"add_latency\",\"n\":%zu,\"p\":%g,"
+        "\"p50_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu,"
+        "\"max_ns\":%llu}\n", n, p, 
+        (unsigned long long)suite_hist_quantile(h, 0.5), 
+        (unsigned long long)suite_hist_quantile(h, 0.99), 
+        (unsigned long long)suite_hist_quantile(h, 0.999),
+        (unsigned long long)h->max);
+    free(h);
+    rhbloom_free(rhbloom);
+}
+
+struct suite_thread {
+    struct rhbloom *rhbloom;
+    size_t start;
+    size_t end;
+    bool add;
+    size_t hits;
+    size_t fails;
+};
+
+void *suite_worker(void *arg) {
+    struct suite_thread *t = arg;
+    for (size_t i = t->start; i < t->end; i++) {
+        if (t->add) {
+            t->fails += !rhbloom_add(t->rhbloom, suite_key(i));
+        } else {
+            t->hits += rhbloom_test(t->rhbloom, suite_key(i));
+        }
+    }
+    return 0;
+}
+
+// Throughput of a concurrent filter with the keys split over the threads.
+void suite_threads(size_t n, double p, int nthreads) {
+    struct rhbloom_options opts = { .concurrent = true };
+    struct rhbloom *rhbloom = rhbloom_new_with_options(n, p, &opts);
+    suite_check(rhbloom, "rhbloom_new");
+    pthread_t threads[64];
+    struct suite_thread ctxs[64];
+    for (int add = 1; add >= 0; add--) {
+        uint64_t start = suite_now_ns();
+        for (int i = 0; i < nthreads; i++) {
+            ctxs[i] = (struct suite_thread){ rhbloom, n*i/nthreads, 
+                n*(i+1)/nthreads, add, 0, 0 };
+            suite_check(!pthread_create(&threads[i], 0, suite_worker, 
+                &ctxs[i]), "pthread_create");
+        }
+        size_t hits = 0;
+        size_t fails = 0;
+        for (int i = 0; i < nthreads; i++) {
+            suite_check(!pthread_join(threads[i], 0), "pthread_join");
+            hits += ctxs[i].hits;
+            fails += ctxs[i].fails;
+        }
+        suite_check(!fails, "rhbloom_add");
+        suite_print(add ? "add" : "test_yes", n, p, "concurrent", nthreads, 
+            n, suite_now_ns() - start);
+        suite_check(add || hits == n, "rhbloom_test");
+    }
+    rhbloom_free(rhbloom);
+}
+
+void suite(int argc, char *argv[]) {
+    size_t maxn = 1048576;
+    if (argc > 2) {
+        maxn = strtoull(argv[2], 0, 10);
+    }
+    double ps[] = { 0.1, 0.01, 0.001 };
+    for (size_t n = 16; n <= maxn; n *= 16) {
+        for (int i = 0; i < 3; i++) {
+            for (int layout = 0; layout < 4; layout++) {
+                suite_paths(n, ps[i], layout);
+            }
+        }
+        suite_latency(n, 0.01);
+        suite_branchless(n, 0.01);
+        for (int t = 1; t <= 8 && n >= 65536; t *= 2) {
+            // Smaller sizes would only measure the thread startup.
+            suite_threads(n, 0.01, t);
+        }
+        fflush(stdout);
+        if (n > maxn / 16 && n < maxn) {
+            // Always finish on the largest size.
+            n = maxn / 16;
+        }
+    }
+}
+
 int main(int argc, char *argv[]) {
     if (argc > 1 && strcmp(argv[1], "bench") == 0) {
         bench(argc, argv);
+    } else if (argc > 1 && strcmp(argv[1], "suite") == 0) {
+        suite(argc, argv);
     } else {
         test();
     }
     return 0;
-}
\ No newline at end of file
+}
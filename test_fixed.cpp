@@ -0,0 +1,48 @@
+// # Check that the headers work from C++
+// $ cc -c rhbloom.c && c++ test_fixed.cpp rhbloom.o -lm -lpthread && ./a.out
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "rhbloom_fixed.h"
+
+RHBLOOM_FIXED(cppfixed, 6, 16, false)
+RHBLOOM_FIXED(cppfixedb, 6, 16, true)
+
+static uint64_t hash(uint64_t key) {
+    key ^= key >> 33;
+    key *= UINT64_C(0xff51afd7ed558ccd);
+    key ^= key >> 33;
+    return key;
+}
+
+int main(void) {
+    static struct cppfixed f;
+    static struct cppfixedb fb;
+    assert(sizeof(f.bits) == 8192 && alignof(struct cppfixed) == 64);
+    for (int i = 0; i < 1000; i++) {
+        cppfixed_add(&f, hash(i));
+        cppfixedb_add(&fb, hash(i));
+    }
+    for (int i = 0; i < 1000; i++) {
+        assert(cppfixed_test(&f, hash(i)));
+        assert(cppfixedb_test(&fb, hash(i)));
+    }
+    // The serialized data round trips through the C library.
+    size_t len = cppfixed_serialize(&f, 0, 0);
+    void *buf = malloc(len);
+    assert(buf && cppfixed_serialize(&f, buf, len) == len);
+    struct rhbloom *rhbloom = rhbloom_deserialize(buf, len, 0);
+    assert(rhbloom);
+    for (int i = 0; i < 1000; i++) {
+        assert(rhbloom_test(rhbloom, hash(i)));
+    }
+    rhbloom_free(rhbloom);
+    cppfixed_clear(&f);
+    assert(!cppfixed_test(&f, hash(0)));
+    assert(cppfixed_deserialize(&f, buf, len));
+    assert(cppfixed_test(&f, hash(0)));
+    free(buf);
+    printf("PASSED\n");
+    return 0;
+}